@@ -4,6 +4,15 @@
 
 %define COM1_BASE 0x3F8
 
+%define KERNEL_SEGMENT    0x1000  ; Kernel is loaded at 0x10000
+%define KERNEL_SECTORS    256     ; 128 KB - bytes past the image are zero
+%define SECTORS_PER_TRACK 18      ; 1.44 MB floppy geometry
+%define HEADS             2
+
+%define E820_MAP_ADDR     0x500   ; Entry count, then 24-byte entries
+%define E820_MAX_ENTRIES  32
+%define SMAP              0x534D4150
+
 ; Set up segments
 cli
 mov ax, 0
@@ -13,6 +22,32 @@ mov ss, ax
 mov sp, 0x7c00
 sti
 
+; Ask the BIOS for the physical memory map (INT 15h, E820) and leave it
+; at E820_MAP_ADDR for the kernel. A count of 0 means no map.
+mov di, E820_MAP_ADDR + 4
+xor ebx, ebx            ; Continuation value, 0 = first entry
+xor bp, bp              ; Entries stored
+e820_next:
+mov eax, 0xE820
+mov edx, SMAP
+mov ecx, 24
+mov dword [es:di + 20], 1   ; ACPI attributes, in case the BIOS returns only 20 bytes
+int 0x15
+jc e820_done            ; Carry: unsupported, or past the last entry
+cmp eax, SMAP
+jne e820_done
+jcxz e820_skip          ; Ignore empty replies
+inc bp
+add di, 24
+e820_skip:
+test ebx, ebx           ; 0 = that was the last entry
+jz e820_done
+cmp bp, E820_MAX_ENTRIES
+jb e820_next
+e820_done:
+mov [E820_MAP_ADDR], bp
+mov word [E820_MAP_ADDR + 2], 0
+
 ; Initialize COM1 (0x3F8) for 9600 baud, 8-N-1
 mov dx, COM1_BASE
 mov al, 0x80            ; Enable DLAB
@@ -54,17 +89,38 @@ call print_string
 mov si, welcome_msg
 call print_string
 
-; Load the kernel from disk
-mov ah, 0x02    ; BIOS read sector function
-mov al, 32      ; Increase sectors read
+; Load the kernel from disk, one sector at a time so reads never cross
+; a track or a 64 KB DMA boundary
+mov ax, KERNEL_SEGMENT
+mov es, ax
+xor bx, bx      ; Memory location to load the kernel (es:bx)
 mov ch, 0       ; Cylinder number
 mov cl, 2       ; Sector number (sectors start from 1, bootloader is at 1)
 mov dh, 0       ; Head number
+mov di, KERNEL_SECTORS
+load_sector:
+mov ax, 0x0201  ; BIOS read sector function, 1 sector
 mov dl, 0       ; Drive number (0 = floppy disk)
-mov bx, 0x1000  ; Memory location to load the kernel
 int 0x13        ; Call BIOS interrupt
 jc disk_error   ; Jump if error (carry flag set)
 
+mov ax, es      ; Advance the destination by 512 bytes
+add ax, 0x20
+mov es, ax
+
+inc cl          ; Next sector, wrapping to the next head and cylinder
+cmp cl, SECTORS_PER_TRACK + 1
+jne next_sector
+mov cl, 1
+inc dh
+cmp dh, HEADS
+jne next_sector
+mov dh, 0
+inc ch
+next_sector:
+dec di
+jnz load_sector
+
 ; Switch to protected mode
 cli                    ; Disable interrupts
 lgdt [gdt_descriptor]  ; Load GDT
@@ -148,8 +204,11 @@ protected_mode_entry:
     ; Set up a stack
     mov esp, 0x90000
     
+    ; Pass the memory map to the kernel
+    mov ebx, E820_MAP_ADDR
+    
     ; Far jump to the kernel using a code segment selector
-    jmp CODE_SEG:0x1000
+    jmp CODE_SEG:(KERNEL_SEGMENT * 16)
 
 ; Padding and boot signature
 times 510-($-$$) db 0
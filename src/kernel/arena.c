@@ -0,0 +1,143 @@
+/* arena.c - Bump-pointer arenas for short-lived allocations */
+#include "arena.h"
+#include "kprintf.h"
+
+/* Round addr up to a multiple of align (a power of two) */
+static inline unsigned int align_up(unsigned int addr, size_t align) {
+    return (addr + align - 1) & ~(align - 1);
+}
+
+/* Create an empty arena. Chunks are at least chunk_pages long. */
+arena_t* arena_create(int chunk_pages) {
+    arena_t* arena = (arena_t*)kmalloc(sizeof(arena_t));
+    if (arena == 0) {
+        return 0;
+    }
+
+    arena->current = 0;
+    arena->used = 0;
+    arena->chunk_pages = chunk_pages > 0 ? chunk_pages : ARENA_CHUNK_PAGES;
+    arena->chunks = 0;
+    arena->pages = 0;
+    arena->allocated = 0;
+    return arena;
+}
+
+/* Start a new chunk with room for size bytes at the given alignment.
+   Whatever is left of the previous chunk is not used again. */
+static int arena_grow(arena_t* arena, size_t size, size_t align) {
+    size_t needed = sizeof(arena_chunk_t) + (align - 1) + size;
+    if (needed < size) {
+        return 0;
+    }
+
+    int pages = (needed + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (pages < arena->chunk_pages) {
+        pages = arena->chunk_pages;
+    }
+
+    // Arena memory is not cleared - callers initialize what they use
+    arena_chunk_t* chunk = (arena_chunk_t*)page_alloc_flags(pages, PAGE_NOZERO);
+    if (chunk == 0) {
+        return 0;
+    }
+
+    chunk->prev = arena->current;
+    chunk->pages = pages;
+    arena->current = chunk;
+    arena->used = sizeof(arena_chunk_t);
+    arena->chunks++;
+    arena->pages += pages;
+    return 1;
+}
+
+/* Allocate size bytes aligned to ARENA_ALIGN. The contents are undefined. */
+void* arena_alloc(arena_t* arena, size_t size) {
+    return arena_alloc_aligned(arena, size, ARENA_ALIGN);
+}
+
+/* Allocate size bytes aligned to align, which must be a power of two */
+void* arena_alloc_aligned(arena_t* arena, size_t size, size_t align) {
+    if (arena == 0 || size == 0) {
+        return 0;
+    }
+    if (align < ARENA_ALIGN) {
+        align = ARENA_ALIGN;
+    }
+
+    unsigned int base = (unsigned int)arena->current;
+    unsigned int addr = align_up(base + arena->used, align);
+
+    // Compare offsets within the chunk so a huge size cannot wrap around
+    size_t room = 0;
+    if (arena->current && addr - base <= (size_t)arena->current->pages * PAGE_SIZE) {
+        room = arena->current->pages * PAGE_SIZE - (addr - base);
+    }
+
+    if (size > room) {
+        if (!arena_grow(arena, size, align)) {
+            return 0;
+        }
+        base = (unsigned int)arena->current;
+        addr = align_up(base + arena->used, align);
+    }
+
+    arena->used = addr + size - base;
+    arena->allocated += size;
+    return (void*)addr;
+}
+
+/* Current position, to be passed to arena_reset() later */
+arena_mark_t arena_mark(arena_t* arena) {
+    arena_mark_t mark;
+    mark.chunk = arena->current;
+    mark.used = arena->used;
+    mark.allocated = arena->allocated;
+    return mark;
+}
+
+/* Release everything allocated since mark was taken. Chunks started after
+   it go back to the page allocator; the one it points into is reused. */
+void arena_reset(arena_t* arena, arena_mark_t mark) {
+    if (arena == 0) {
+        return;
+    }
+
+    while (arena->current && arena->current != mark.chunk) {
+        arena_chunk_t* chunk = arena->current;
+        arena->current = chunk->prev;
+        arena->chunks--;
+        arena->pages -= chunk->pages;
+        page_free(chunk);
+    }
+
+    // A mark into a chunk freed by an earlier reset rewinds to the start
+    if (arena->current == mark.chunk) {
+        arena->used = mark.used;
+        arena->allocated = mark.allocated;
+    } else {
+        arena->used = 0;
+        arena->allocated = 0;
+    }
+}
+
+/* Free every chunk and the arena itself */
+void arena_destroy(arena_t* arena) {
+    if (arena == 0) {
+        return;
+    }
+
+    arena_mark_t empty = { 0, 0, 0 };
+    arena_reset(arena, empty);
+    kfree(arena);
+}
+
+/* Print how much an arena holds */
+void print_arena_stats(arena_t* arena) {
+    if (arena == 0) {
+        return;
+    }
+
+    kprintf("Arena: %u bytes allocated in %d %s, %d pages held\n", arena->allocated,
+            arena->chunks, arena->chunks == 1 ? "chunk" : "chunks", arena->pages);
+}
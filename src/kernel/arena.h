@@ -0,0 +1,43 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "memory.h"
+
+/* Default chunk size and the alignment of arena_alloc() */
+#define ARENA_CHUNK_PAGES 4
+#define ARENA_ALIGN       8
+
+/* Chunk header - stored at the start of each chunk's first page */
+typedef struct arena_chunk {
+    struct arena_chunk* prev;   // Chunk filled before this one
+    int pages;                  // Pages in this chunk
+} arena_chunk_t;
+
+/* Bump-pointer arena - memory is handed out from the newest chunk and
+   only given back all at once by arena_reset() or arena_destroy() */
+typedef struct {
+    arena_chunk_t* current;     // Newest chunk, 0 before the first allocation
+    size_t used;                // Bytes used in the newest chunk, header included
+    int chunk_pages;            // Minimum pages per chunk
+    int chunks;                 // Chunks held
+    int pages;                  // Pages held by all chunks
+    size_t allocated;           // Bytes handed out
+} arena_t;
+
+/* Position to rewind to with arena_reset() */
+typedef struct {
+    arena_chunk_t* chunk;
+    size_t used;
+    size_t allocated;
+} arena_mark_t;
+
+/* Function prototypes */
+arena_t* arena_create(int chunk_pages);     /* No pages are taken until the first allocation */
+void* arena_alloc(arena_t* arena, size_t size);
+void* arena_alloc_aligned(arena_t* arena, size_t size, size_t align); /* align: power of two */
+arena_mark_t arena_mark(arena_t* arena);
+void arena_reset(arena_t* arena, arena_mark_t mark);   /* Free everything allocated after mark */
+void arena_destroy(arena_t* arena);
+void print_arena_stats(arena_t* arena);
+
+#endif /* ARENA_H */
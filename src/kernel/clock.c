@@ -0,0 +1,201 @@
+/* clock.c - PIT timer interrupt and TSC-based timekeeping */
+#include "clock.h"
+#include "cpu.h"
+#include "idt.h"
+#include "pic.h"
+#include "thread.h"
+#include "console.h"
+#include "kprintf.h"
+
+/* Forward declaration of print function */
+void print(const char *str);
+
+/* Port I/O (kernel.c, keyboard.c) */
+void outb(unsigned short port, unsigned char value);
+unsigned char inb(unsigned short port);
+
+#define PIT_DIVISOR ((PIT_FREQUENCY + CLOCK_HZ / 2) / CLOCK_HZ)
+
+static volatile unsigned long long ticks = 0;
+static unsigned int tick_ns = 0;            // Nanoseconds per timer interrupt
+static unsigned int tsc_khz = 0;            // 0 = no usable TSC
+static unsigned long long tsc_mult = 0;     // Nanoseconds per cycle, 32.32 fixed point
+static unsigned long long tsc_boot = 0;     // TSC when the clock started
+
+/* IRQ 0 */
+static void timer_irq(interrupt_frame_t* frame) {
+    (void)frame;
+    ticks++;
+    thread_tick();
+    console_tick();
+}
+
+/* (a * b) >> 32, without needing a 128-bit product */
+static unsigned long long mul_shift32(unsigned long long a, unsigned long long b) {
+    unsigned int a_lo = (unsigned int)a;
+    unsigned int a_hi = (unsigned int)(a >> 32);
+    unsigned int b_lo = (unsigned int)b;
+    unsigned int b_hi = (unsigned int)(b >> 32);
+
+    unsigned long long result = ((unsigned long long)a_hi * b_hi) << 32;
+    result += (unsigned long long)a_hi * b_lo;
+    result += (unsigned long long)a_lo * b_hi;
+    result += ((unsigned long long)a_lo * b_lo) >> 32;
+    return result;
+}
+
+/* TSC rate measured over one CLOCK_CALIBRATE_MS one-shot of PIT channel 2 */
+static unsigned int measure_tsc_khz() {
+    unsigned int count = PIT_FREQUENCY / (1000 / CLOCK_CALIBRATE_MS);
+    unsigned char gate = inb(PIT_GATE_PORT);
+
+    // Gate on, speaker off, then mode 0: the output rises when the count runs out
+    outb(PIT_GATE_PORT, (gate & ~0x02) | 0x01);
+    outb(PIT_COMMAND, 0xB0);
+    outb(PIT_CHANNEL2, count & 0xFF);
+    outb(PIT_CHANNEL2, count >> 8);
+
+    unsigned long long start = rdtsc();
+    while (!(inb(PIT_GATE_PORT) & 0x20)) {
+    }
+    unsigned long long end = rdtsc();
+
+    outb(PIT_GATE_PORT, gate);
+    return (unsigned int)(end - start) / CLOCK_CALIBRATE_MS;
+}
+
+/* Start the CLOCK_HZ timer interrupt and calibrate the TSC against the
+   PIT. Interrupts must still be off so nothing stretches a calibration run. */
+void init_clock() {
+    unsigned int eax, ebx, ecx, edx;
+
+    if (cpuid_supported()) {
+        cpuid(1, &eax, &ebx, &ecx, &edx);
+        if (edx & CPUID_FEAT_EDX_TSC) {
+            for (int i = 0; i < CLOCK_CALIBRATE_RUNS; i++) {
+                // An interrupted or slow run only makes the count larger
+                unsigned int khz = measure_tsc_khz();
+                if (tsc_khz == 0 || khz < tsc_khz) {
+                    tsc_khz = khz;
+                }
+            }
+        }
+    }
+    if (tsc_khz) {
+        tsc_mult = div64_32(1000000ULL << 32, tsc_khz, 0);
+        tsc_boot = rdtsc();
+    }
+
+    // Channel 0, rate generator
+    tick_ns = (unsigned int)div64_32(1000000000ULL * PIT_DIVISOR, PIT_FREQUENCY, 0);
+    outb(PIT_COMMAND, 0x34);
+    outb(PIT_CHANNEL0, PIT_DIVISOR & 0xFF);
+    outb(PIT_CHANNEL0, PIT_DIVISOR >> 8);
+
+    register_interrupt_handler(IRQ_BASE + IRQ_TIMER, timer_irq);
+    pic_unmask(IRQ_TIMER);
+}
+
+/* Timer interrupts so far. The IRQ can land between the two halves of
+   the 64-bit read, so read until two reads agree. */
+unsigned long long clock_ticks() {
+    unsigned long long first, second;
+    do {
+        first = ticks;
+        second = ticks;
+    } while (first != second);
+    return first;
+}
+
+/* Raw cycle counter */
+unsigned long long clock_cycles() {
+    return tsc_khz ? rdtsc() : 0;
+}
+
+/* Convert a TSC difference to nanoseconds */
+unsigned long long clock_cycles_to_ns(unsigned long long cycles) {
+    return mul_shift32(cycles, tsc_mult);
+}
+
+/* Nanoseconds since init_clock() - TSC resolution when there is one,
+   otherwise whole timer ticks */
+unsigned long long clock_ns() {
+    if (tsc_khz) {
+        return clock_cycles_to_ns(rdtsc() - tsc_boot);
+    }
+    return clock_ticks() * tick_ns;
+}
+
+unsigned long long uptime_ms() {
+    return div64_32(clock_ns(), 1000000, 0);
+}
+
+unsigned int clock_tsc_khz() {
+    return tsc_khz;
+}
+
+/* Wait at least ms milliseconds - as a sleeping thread once threads
+   run, before that halting between timer interrupts */
+void sleep_ms(unsigned int ms) {
+    if (thread_current()) {
+        thread_sleep(ms);
+        return;
+    }
+    
+    unsigned long long end = clock_ns() + (unsigned long long)ms * 1000000;
+    while (clock_ns() < end) {
+        __asm__ volatile("hlt");
+    }
+}
+
+/* Busy-wait at least us microseconds, for hardware that needs short
+   delays. Works with interrupts off when there is a TSC. */
+void delay_us(unsigned int us) {
+    unsigned long long end = clock_ns() + (unsigned long long)us * 1000;
+    while (clock_ns() < end) {
+        __asm__ volatile("pause");
+    }
+}
+
+/* Print a duration with a unit that keeps 3 decimals meaningful */
+void print_duration(unsigned long long ns) {
+    unsigned int divisor = 1;
+    const char* unit = " ns";
+    unsigned int frac;
+
+    if (ns >= 1000000000ULL) {
+        divisor = 1000000;
+        unit = " s";
+    } else if (ns >= 1000000) {
+        divisor = 1000;
+        unit = " ms";
+    } else if (ns >= 1000) {
+        divisor = 1;
+        unit = " us";
+    } else {
+        kprintf("%u%s", (unsigned int)ns, unit);
+        return;
+    }
+
+    // Three decimals: whole units, then thousandths
+    unsigned long long thousandths = div64_32(ns, divisor, 0);
+    unsigned long long whole = div64_32(thousandths, 1000, &frac);
+    kprintf("%llu.%03u%s", whole, frac, unit);
+}
+
+/* Uptime and clock sources */
+void print_clock_info() {
+    unsigned int ms;
+    unsigned long long seconds = div64_32(uptime_ms(), 1000, &ms);
+    unsigned int secs, mins;
+    unsigned long long minutes = div64_32(seconds, 60, &secs);
+    unsigned long long hours = div64_32(minutes, 60, &mins);
+
+    kprintf("\nUp %llu:%02u:%02u.%03u\n", hours, mins, secs, ms);
+    kprintf("  Timer: %d Hz, %llu ticks\n  TSC: ", CLOCK_HZ, clock_ticks());
+    if (tsc_khz) {
+        kprintf("%u.%u MHz, calibrated against the PIT\n", tsc_khz / 1000, tsc_khz % 1000 / 100);
+    } else {
+        print("not available, time has timer resolution\n");
+    }
+}
@@ -0,0 +1,28 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+/* Programmable interval timer */
+#define PIT_FREQUENCY   1193182     /* Input clock, Hz */
+#define PIT_CHANNEL0    0x40        /* System timer, IRQ 0 */
+#define PIT_CHANNEL2    0x42        /* Speaker channel, used to calibrate the TSC */
+#define PIT_COMMAND     0x43
+#define PIT_GATE_PORT   0x61        /* Bit 0: channel 2 gate, bit 5: channel 2 output */
+
+#define CLOCK_HZ            1000    /* Timer interrupts per second */
+#define CLOCK_CALIBRATE_MS  10      /* Length of one TSC calibration run */
+#define CLOCK_CALIBRATE_RUNS 3      /* The shortest run wins */
+
+/* Function prototypes */
+void init_clock();                  /* Call with interrupts off, before sti */
+unsigned long long clock_cycles();  /* TSC, 0 if the CPU has none */
+unsigned long long clock_ns();      /* Monotonic nanoseconds since init_clock() */
+unsigned long long clock_ticks();   /* Timer interrupts since init_clock() */
+unsigned long long clock_cycles_to_ns(unsigned long long cycles);
+unsigned long long uptime_ms();
+unsigned int clock_tsc_khz();       /* 0 when time comes from the timer alone */
+void sleep_ms(unsigned int ms);     /* Needs interrupts on */
+void delay_us(unsigned int us);     /* Busy wait */
+void print_duration(unsigned long long ns);
+void print_clock_info();
+
+#endif /* CLOCK_H */
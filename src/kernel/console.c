@@ -0,0 +1,463 @@
+/* console.c - VGA text console behind a RAM shadow of the screen */
+#include "console.h"
+#include "string.h"
+#include "clock.h"
+#include "cpu.h"
+#include "memory.h"
+#include "kprintf.h"
+#include "serial.h"
+#include "spinlock.h"
+
+/* Port I/O from kernel.c */
+void outb(unsigned short port, unsigned char value);
+unsigned char inb(unsigned short port);
+
+/* Current cursor position - outside this file through
+   console_get_cursor() and console_set_cursor() */
+static int cursor_x = 0;
+static int cursor_y = 0;
+
+/* What VGA text memory should hold, laid out the same way. VGA memory
+   only ever gets writes, copied from here a dirty row at a time - reading
+   it back is slow. The screen is rows top_row to top_row + 24. */
+static unsigned short shadow[CONSOLE_RING_ROWS * CONSOLE_COLS];
+static int top_row = 0;
+static unsigned int dirty_rows = 0;         // Bit per screen row changed since the last flush
+static int cursor_moved = 0;
+static int hw_cursor = -1;                  // Cell offset last given to the VGA
+static int hw_top = -1;                     // Start row last given to the VGA
+static int write_through = 0;               // Flush after every character (consbench)
+static int ticks_since_flush = 0;
+
+/* Guards the shadow, the scrollback and the flush state. Every CPU
+   prints, and the timer interrupt flushes, so it is taken with
+   interrupts off - by the exported functions; the static helpers
+   expect it held. */
+static spinlock_t console_lock = SPINLOCK_INIT;
+
+/* Scrollback: lines that have left the top of the screen, oldest first
+   from history_count lines before history_next. view_offset is how many
+   lines back the screen is showing, 0 when live. */
+static unsigned short* history = 0;
+static int history_lines = 0;               // Capacity
+static int history_count = 0;
+static int history_next = 0;                // Slot the next line goes in
+static int view_offset = 0;
+static int view_dirty = 0;                  // Window needs drawing from the scrollback
+
+/* Counters for consbench */
+static unsigned int chars_printed = 0;
+static unsigned int flushes = 0;
+static unsigned int cursor_writes = 0;
+static unsigned int scrolls = 0;
+static unsigned int wraps = 0;              // Screen copied back to the top of the ring
+
+static inline unsigned short blank_cell() {
+    return (CONSOLE_COLOR << 8) | ' ';
+}
+
+/* Shadow cell at screen position (x, y) */
+static inline unsigned short* cell(int x, int y) {
+    return &shadow[(top_row + y) * CONSOLE_COLS + x];
+}
+
+/* Scrollback line i, 0 being the oldest kept */
+static inline unsigned short* history_line(int i) {
+    int slot = history_next - history_count + i;
+    if (slot < 0) {
+        slot += history_lines;
+    }
+    return history + slot * CONSOLE_COLS;
+}
+
+/* Point the CRTC at the first cell of the screen - four port writes */
+static void write_start(int offset) {
+    outb(VGA_CRTC_INDEX, VGA_START_LOW);
+    outb(VGA_CRTC_DATA, (unsigned char)(offset & 0xFF));
+    outb(VGA_CRTC_INDEX, VGA_START_HIGH);
+    outb(VGA_CRTC_DATA, (unsigned char)((offset >> 8) & 0xFF));
+}
+
+/* Program the hardware cursor - four port writes */
+static void write_cursor(int position) {
+    outb(VGA_CRTC_INDEX, VGA_CURSOR_LOW);
+    outb(VGA_CRTC_DATA, (unsigned char)(position & 0xFF));
+    outb(VGA_CRTC_INDEX, VGA_CURSOR_HIGH);
+    outb(VGA_CRTC_DATA, (unsigned char)((position >> 8) & 0xFF));
+    cursor_writes++;
+}
+
+/* Show the cursor as an underline and start from a blank screen */
+void init_console() {
+    // Enable cursor, set scanline start/end
+    outb(VGA_CRTC_INDEX, VGA_CURSOR_START);
+    outb(VGA_CRTC_DATA, (inb(VGA_CRTC_DATA) & 0xC0) | 0);
+    outb(VGA_CRTC_INDEX, VGA_CURSOR_END);
+    outb(VGA_CRTC_DATA, (inb(VGA_CRTC_DATA) & 0xE0) | 0x0F);
+
+    clear_screen();
+    console_flush();
+}
+
+/* Keep the lines scrolled off the top in a ring of lines on the heap */
+void console_init_scrollback(int lines) {
+    unsigned short* buffer = (unsigned short*)kmalloc(lines * CONSOLE_COLS * sizeof(unsigned short));
+    if (!buffer) {
+        print("ERROR: No memory for console scrollback\n");
+        return;
+    }
+
+    unsigned int flags = spin_lock_irqsave(&console_lock);
+    history = buffer;
+    history_lines = lines;
+    history_count = 0;
+    history_next = 0;
+    spin_unlock_irqrestore(&console_lock, flags);
+}
+
+/* Keep the top screen line before it scrolls away - one line copied, the
+   oldest overwritten once the ring is full */
+static void save_line(const unsigned short* line) {
+    if (!history) {
+        return;
+    }
+    memcpy(history + history_next * CONSOLE_COLS, line, CONSOLE_COLS * sizeof(unsigned short));
+    if (++history_next == history_lines) {
+        history_next = 0;
+    }
+    if (history_count < history_lines) {
+        history_count++;
+    }
+}
+
+/* Fill the screen window in VGA memory from view_offset lines back: the
+   scrollback, then the top of the live screen. The shadow is left alone. */
+static void draw_view(unsigned short* video_memory) {
+    int first = history_count - view_offset;
+    for (int y = 0; y < CONSOLE_ROWS; y++) {
+        int line = first + y;
+        const unsigned short* src = line < history_count ?
+                                    history_line(line) : cell(0, line - history_count);
+        memcpy(video_memory + (top_row + y) * CONSOLE_COLS, src,
+               CONSOLE_COLS * sizeof(unsigned short));
+    }
+}
+
+/* Move the view lines back into the scrollback (negative: towards the
+   live screen), clamped to what is kept. Drawn at the next flush. */
+void console_scroll_view(int lines) {
+    unsigned int flags = spin_lock_irqsave(&console_lock);
+    int offset = view_offset + lines;
+    if (offset > history_count) {
+        offset = history_count;
+    }
+    if (offset < 0) {
+        offset = 0;
+    }
+
+    if (offset != view_offset) {
+        view_offset = offset;
+        if (offset > 0) {
+            view_dirty = 1;
+        } else {
+            dirty_rows = (1u << CONSOLE_ROWS) - 1;
+        }
+        cursor_moved = 1;
+    }
+    spin_unlock_irqrestore(&console_lock, flags);
+}
+
+/* Anything written to the screen brings the live view back */
+static inline void snap_to_live() {
+    if (view_offset) {
+        view_offset = 0;
+        dirty_rows = (1u << CONSOLE_ROWS) - 1;
+        cursor_moved = 1;
+    }
+}
+
+/* Copy the rows changed since the last flush to VGA memory, each run of
+   adjacent rows in one go, then move the start address and the cursor if
+   they have changed. The rows go first, so a scroll never shows a stale
+   bottom line. While the scrollback is showing, only a change of view
+   is drawn. */
+static void flush_locked() {
+    unsigned short* video_memory = (unsigned short*)VIDEO_MEMORY;
+    unsigned int dirty = dirty_rows;
+
+    dirty_rows = 0;
+    if (view_offset) {
+        if (view_dirty) {
+            draw_view(video_memory);
+        }
+        dirty = 0;
+    }
+    view_dirty = 0;
+
+    int row = 0;
+    while (row < CONSOLE_ROWS) {
+        if (!(dirty & (1u << row))) {
+            row++;
+            continue;
+        }
+        int first = row;
+        while (row < CONSOLE_ROWS && (dirty & (1u << row))) {
+            row++;
+        }
+        int offset = (top_row + first) * CONSOLE_COLS;
+        memcpy(video_memory + offset, shadow + offset,
+               (row - first) * CONSOLE_COLS * sizeof(unsigned short));
+    }
+
+    if (top_row != hw_top) {
+        write_start(top_row * CONSOLE_COLS);
+        hw_top = top_row;
+    }
+
+    // The cursor register counts from the start of text memory. Paging
+    // back parks it just below the window, out of sight.
+    int position = (top_row + cursor_y) * CONSOLE_COLS + cursor_x;
+    if (view_offset) {
+        position = (top_row + CONSOLE_ROWS) * CONSOLE_COLS;
+    }
+    if (position != hw_cursor) {
+        write_cursor(position);
+        hw_cursor = position;
+    }
+    cursor_moved = 0;
+    flushes++;
+}
+
+void console_flush() {
+    unsigned int flags = spin_lock_irqsave(&console_lock);
+    flush_locked();
+    spin_unlock_irqrestore(&console_lock, flags);
+}
+
+/* Flush every CONSOLE_FLUSH_MS while a command keeps the shell busy.
+   The unlocked look at dirty_rows only decides whether to flush. */
+void console_tick() {
+    if (++ticks_since_flush >= CONSOLE_FLUSH_MS * CLOCK_HZ / 1000) {
+        ticks_since_flush = 0;
+        if (dirty_rows || cursor_moved) {
+            console_flush();
+        }
+    }
+}
+
+static void putchar_locked(char c, int x, int y) {
+    snap_to_live();
+    *cell(x, y) = (CONSOLE_COLOR << 8) | (unsigned char)c;
+    dirty_rows |= 1u << y;
+}
+
+/* Function to write a character to the screen */
+void putchar(char c, int x, int y) {
+    unsigned int flags = spin_lock_irqsave(&console_lock);
+    putchar_locked(c, x, y);
+    spin_unlock_irqrestore(&console_lock, flags);
+}
+
+/* Function to clear the screen */
+void clear_screen() {
+    unsigned int flags = spin_lock_irqsave(&console_lock);
+    snap_to_live();
+    top_row = 0;
+    memsetw(shadow, blank_cell(), CONSOLE_ROWS * CONSOLE_COLS);
+    dirty_rows = (1u << CONSOLE_ROWS) - 1;
+    cursor_x = 0;
+    cursor_y = 0;
+    cursor_moved = 1;
+    spin_unlock_irqrestore(&console_lock, flags);
+}
+
+/* Function to print a string at specific position */
+void print_string(const char *str, int x, int y) {
+    unsigned int flags = spin_lock_irqsave(&console_lock);
+    int i = 0;
+    while(str[i] != '\0') {
+        putchar_locked(str[i], x + i, y);
+        i++;
+    }
+    spin_unlock_irqrestore(&console_lock, flags);
+}
+
+/* Scroll the screen up by one line. The window moves one row down the
+   ring, so rows already in VGA memory stay put and only the new bottom
+   line is drawn. At the end of the ring the 24 rows kept are copied back
+   to the top and the whole screen is redrawn once. The line leaving the
+   top goes to the scrollback first. */
+static void scroll_screen() {
+    save_line(cell(0, 0));
+    if (top_row + CONSOLE_ROWS < CONSOLE_RING_ROWS) {
+        top_row++;
+        dirty_rows = (dirty_rows >> 1) | (1u << (CONSOLE_ROWS - 1));
+    } else {
+        memmove(shadow, cell(0, 1), (CONSOLE_ROWS - 1) * CONSOLE_COLS * sizeof(unsigned short));
+        top_row = 0;
+        dirty_rows = (1u << CONSOLE_ROWS) - 1;
+        wraps++;
+    }
+    scrolls++;
+
+    // Clear the last line
+    memsetw(cell(0, CONSOLE_ROWS - 1), blank_cell(), CONSOLE_COLS);
+}
+
+/* Put a character at the cursor and move it on, scrolling at the bottom */
+static void emit(char c) {
+    if (c == '\n') {
+        cursor_x = 0;
+        cursor_y++;
+    } else if (c == '\b') {
+        if (cursor_x > 0) {
+            // Move back one position and erase the character there
+            cursor_x--;
+            putchar_locked(' ', cursor_x, cursor_y);
+        }
+    } else {
+        putchar_locked(c, cursor_x, cursor_y);
+        cursor_x++;
+
+        // Handle line wrapping
+        if (cursor_x >= CONSOLE_COLS) {
+            cursor_x = 0;
+            cursor_y++;
+        }
+    }
+
+    // Check if we need to scroll the screen
+    if (cursor_y >= CONSOLE_ROWS) {
+        scroll_screen();
+        cursor_y = CONSOLE_ROWS - 1; // Keep cursor at the last line
+    }
+}
+
+/* Write len characters at the cursor - the work per string, rather than
+   per character, is done once. The serial console gets a copy, queued
+   before console_lock is taken. */
+void console_write(const char* str, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    serial_write(str, len);
+
+    unsigned int flags = spin_lock_irqsave(&console_lock);
+    snap_to_live();
+    for (size_t i = 0; i < len; i++) {
+        emit(str[i]);
+        if (write_through) {
+            flush_locked();
+        }
+    }
+    cursor_moved = 1;
+    chars_printed += len;
+    spin_unlock_irqrestore(&console_lock, flags);
+}
+
+/* Print a character at the current cursor position and update cursor */
+void print_char(char c) {
+    console_write(&c, 1);
+}
+
+/* Print a string at the current cursor position */
+void print(const char *str) {
+    console_write(str, strlen(str));
+}
+
+/* Function to print an integer at the current cursor position */
+void print_int(int num) {
+    kprintf("%d", num);
+}
+
+/* Print an unsigned 64-bit integer at the current cursor position */
+void print_u64(unsigned long long num) {
+    kprintf("%llu", num);
+}
+
+/* Where the next character goes */
+void console_get_cursor(int* x, int* y) {
+    unsigned int flags = spin_lock_irqsave(&console_lock);
+    *x = cursor_x;
+    *y = cursor_y;
+    spin_unlock_irqrestore(&console_lock, flags);
+}
+
+/* Move the cursor - the hardware cursor follows at the next flush */
+void console_set_cursor(int x, int y) {
+    unsigned int flags = spin_lock_irqsave(&console_lock);
+    cursor_x = x;
+    cursor_y = y;
+    cursor_moved = 1;
+    spin_unlock_irqrestore(&console_lock, flags);
+}
+
+/* Print CONSOLE_BENCH_LINES lines and time them, with the screen and
+   cursor updated after every character or only at the end */
+static unsigned long long console_bench_pass(int through, unsigned int* chars, unsigned int* writes) {
+    unsigned int start_chars = chars_printed;
+    unsigned int start_writes = cursor_writes;
+
+    console_flush();
+    write_through = through;
+    unsigned long long start = clock_ns();
+    for (int line = 0; line < CONSOLE_BENCH_LINES; line++) {
+        print(through ? "unbuffered " : "buffered ");
+        print_int(line);
+        print(": the quick brown fox jumps over the lazy dog 0123456789\n");
+    }
+    console_flush();
+    unsigned long long elapsed = clock_ns() - start;
+    write_through = 0;
+
+    *chars = chars_printed - start_chars;
+    *writes = cursor_writes - start_writes;
+    return elapsed;
+}
+
+/* Report one pass */
+static void console_bench_report(const char* label, unsigned long long ns,
+                                 unsigned int chars, unsigned int writes) {
+    unsigned int us = (unsigned int)div64_32(ns, 1000, 0);
+    if (us == 0) {
+        us = 1;
+    }
+
+    print("  ");
+    print(label);
+    print_int(chars);
+    print(" chars in ");
+    print_duration(ns);
+    print(", ");
+    print_u64(div64_32((unsigned long long)chars * 1000000, us, 0));
+    print(" chars/s, ");
+    print_int(writes);
+    print(" cursor updates\n");
+}
+
+/* Compare writing every character through to VGA memory and the cursor,
+   as the console used to, with flushing the shadow once */
+void run_console_benchmark() {
+    unsigned int direct_chars, direct_writes, buffered_chars, buffered_writes;
+
+    unsigned long long direct = console_bench_pass(1, &direct_chars, &direct_writes);
+    unsigned long long buffered = console_bench_pass(0, &buffered_chars, &buffered_writes);
+
+    print("\nConsole output, ");
+    print_int(CONSOLE_BENCH_LINES);
+    print(" lines:\n");
+    console_bench_report("Unbuffered: ", direct, direct_chars, direct_writes);
+    console_bench_report("Buffered:   ", buffered, buffered_chars, buffered_writes);
+    print("  ");
+    print_int(flushes);
+    print(" flushes, ");
+    print_int(scrolls);
+    print(" scrolls, ");
+    print_int(wraps);
+    print(" ring wraps since boot\n");
+    print("  Scrollback: ");
+    print_int(history_count);
+    print(" of ");
+    print_int(history_lines);
+    print(" lines kept\n");
+}
@@ -0,0 +1,59 @@
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+#include "memory.h"
+
+/* VGA text mode screen */
+#define VIDEO_MEMORY     0xB8000
+#define CONSOLE_COLS     80
+#define CONSOLE_ROWS     25
+#define CONSOLE_COLOR    0x0F       /* White on black */
+
+/* The 32 KB of text memory is used as a ring of rows. Scrolling moves the
+   CRTC start address down it; the screen is copied back to the top only
+   when the window reaches the end. */
+#define VGA_TEXT_CELLS   16384
+#define CONSOLE_RING_ROWS (VGA_TEXT_CELLS / CONSOLE_COLS)
+
+/* Output goes to a RAM copy of the screen and reaches VGA memory when
+   flushed - when the shell waits for a key, and from the timer so long
+   commands still show progress */
+#define CONSOLE_FLUSH_MS 20
+
+/* Lines that scroll off the top are kept in a ring on the kernel heap,
+   CONSOLE_SCROLLBACK_LINES * 160 bytes, paged with Shift+PgUp/PgDn */
+#define CONSOLE_SCROLLBACK_LINES 2000
+#define CONSOLE_PAGE_LINES (CONSOLE_ROWS - 1)   /* Keep one line of context */
+
+/* VGA CRT controller */
+#define VGA_CRTC_INDEX   0x3D4
+#define VGA_CRTC_DATA    0x3D5
+#define VGA_CURSOR_START 0x0A       /* Cursor shape: first scanline, bit 5 hides it */
+#define VGA_CURSOR_END   0x0B       /* Cursor shape: last scanline */
+#define VGA_START_HIGH   0x0C       /* Cell shown at the top left */
+#define VGA_START_LOW    0x0D
+#define VGA_CURSOR_HIGH  0x0E
+#define VGA_CURSOR_LOW   0x0F
+
+/* consbench: lines printed per pass */
+#define CONSOLE_BENCH_LINES 500
+
+/* Function prototypes */
+void init_console();                /* Show the cursor and clear the screen */
+void putchar(char c, int x, int y);
+void print_string(const char* str, int x, int y);
+void console_write(const char* str, size_t len);
+void print_char(char c);
+void print(const char* str);
+void print_int(int num);
+void print_u64(unsigned long long num);
+void clear_screen();
+void console_init_scrollback(int lines); /* Needs the heap - after init_memory() */
+void console_scroll_view(int lines);    /* Back into the scrollback, negative towards live */
+void console_get_cursor(int* x, int* y);
+void console_set_cursor(int x, int y);  /* The hardware cursor moves at the next flush */
+void console_flush();               /* Copy dirty rows to VGA memory, then the cursor */
+void console_tick();                /* Timer interrupt */
+void run_console_benchmark();       /* Characters per second, unbuffered and buffered */
+
+#endif /* CONSOLE_H */
@@ -0,0 +1,151 @@
+#ifndef CPU_H
+#define CPU_H
+
+/* CPUID feature bits (leaf 1, EDX) */
+#define CPUID_FEAT_EDX_TSC   (1 << 4)
+#define CPUID_FEAT_EDX_PAE   (1 << 6)
+#define CPUID_FEAT_EDX_FXSR  (1 << 24)
+#define CPUID_FEAT_EDX_SSE   (1 << 25)
+#define CPUID_FEAT_EDX_SSE2  (1 << 26)
+
+/* CPUID extended feature bits (leaf 0x80000001, EDX) */
+#define CPUID_EXT_FEAT_EDX_NX (1 << 20)
+
+/* Control register bits */
+#define CR0_MP          (1 << 1)    /* Monitor coprocessor */
+#define CR0_EM          (1 << 2)    /* x87 emulation - must be clear for SSE */
+#define CR0_WP          (1 << 16)   /* Read-only pages apply to ring 0 too */
+#define CR0_PG          (1u << 31)  /* Paging */
+#define CR4_PAE         (1 << 5)    /* Physical address extension (64-bit entries) */
+#define CR4_OSFXSR      (1 << 9)    /* OS supports FXSAVE/FXRSTOR and SSE */
+#define CR4_OSXMMEXCPT  (1 << 10)   /* OS handles SIMD floating point exceptions */
+
+/* EFLAGS bits */
+#define EFLAGS_IF       (1 << 9)    /* Interrupts enabled */
+
+/* Model specific registers */
+#define MSR_EFER        0xC0000080
+#define EFER_NXE        (1 << 11)   /* No-execute bit in PAE page tables */
+
+/* Execute CPUID for a leaf */
+static inline void cpuid(unsigned int leaf, unsigned int* eax, unsigned int* ebx,
+                         unsigned int* ecx, unsigned int* edx) {
+    __asm__ volatile("cpuid"
+                     : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                     : "a"(leaf), "c"(0));
+}
+
+/* Check whether the CPUID instruction exists (EFLAGS.ID can be toggled) */
+static inline int cpuid_supported() {
+    unsigned int before, after;
+    __asm__ volatile("pushfl\n\t"
+                     "pop %0\n\t"
+                     "mov %0, %1\n\t"
+                     "xor $0x200000, %1\n\t"
+                     "push %1\n\t"
+                     "popfl\n\t"
+                     "pushfl\n\t"
+                     "pop %1\n\t"
+                     "push %0\n\t"
+                     "popfl"
+                     : "=&r"(before), "=&r"(after));
+    return ((before ^ after) & 0x200000) != 0;
+}
+
+/* Control register access */
+static inline unsigned int read_cr0() {
+    unsigned int value;
+    __asm__ volatile("mov %%cr0, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr0(unsigned int value) {
+    __asm__ volatile("mov %0, %%cr0" : : "r"(value) : "memory");
+}
+
+static inline unsigned int read_cr4() {
+    unsigned int value;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr4(unsigned int value) {
+    __asm__ volatile("mov %0, %%cr4" : : "r"(value) : "memory");
+}
+
+static inline unsigned int read_cr2() {
+    unsigned int value;
+    __asm__ volatile("mov %%cr2, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr3(unsigned int value) {
+    __asm__ volatile("mov %0, %%cr3" : : "r"(value) : "memory");
+}
+
+/* Drop the TLB entry for one page */
+static inline void invlpg(void* addr) {
+    __asm__ volatile("invlpg (%0)" : : "r"(addr) : "memory");
+}
+
+/* Model specific register access */
+static inline unsigned long long rdmsr(unsigned int msr) {
+    unsigned int lo, hi;
+    __asm__ volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((unsigned long long)hi << 32) | lo;
+}
+
+static inline void wrmsr(unsigned int msr, unsigned long long value) {
+    __asm__ volatile("wrmsr" : : "c"(msr), "a"((unsigned int)value),
+                     "d"((unsigned int)(value >> 32)));
+}
+
+#ifdef NOX_HOST
+/* Host builds of the allocators (tests/host) run single threaded in user mode */
+static inline unsigned int irq_save() {
+    return 0;
+}
+
+static inline void irq_restore(unsigned int flags) {
+    (void)flags;
+}
+#else
+/* Disable interrupts, returning the previous EFLAGS for irq_restore().
+   Pairs nest, so code holding interrupts off can call code that does too. */
+static inline unsigned int irq_save() {
+    unsigned int flags;
+    __asm__ volatile("pushfl; popl %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+/* Re-enable interrupts if they were on at the matching irq_save() */
+static inline void irq_restore(unsigned int flags) {
+    if (flags & EFLAGS_IF) {
+        __asm__ volatile("sti" : : : "memory");
+    }
+}
+#endif
+
+/* Read the CPU timestamp counter */
+static inline unsigned long long rdtsc() {
+    unsigned int lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((unsigned long long)hi << 32) | lo;
+}
+
+/* Divide a 64-bit value by a 32-bit one without libgcc. The high half
+   goes first, so the remainder fed to the second divl keeps its quotient
+   within 32 bits. */
+static inline unsigned long long div64_32(unsigned long long n, unsigned int d, unsigned int* rem) {
+    unsigned int hi = (unsigned int)(n >> 32);
+    unsigned int q_hi = hi / d;
+    unsigned int r = hi % d;
+    unsigned int q_lo;
+    __asm__("divl %4" : "=a"(q_lo), "=d"(r) : "a"((unsigned int)n), "d"(r), "rm"(d));
+    if (rem) {
+        *rem = r;
+    }
+    return ((unsigned long long)q_hi << 32) | q_lo;
+}
+
+#endif /* CPU_H */
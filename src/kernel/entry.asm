@@ -2,6 +2,8 @@
 [bits 32]
 [global _start]
 [extern kernel_main]  ; Make sure this matches your C function name
+[extern bss_start]
+[extern bss_end]
 
 section .text
 _start:
@@ -11,10 +13,20 @@ _start:
     mov byte [0xB8004], 'E'
     mov byte [0xB8005], 0x07
     
+    ; Clear .bss - it is not part of the flat binary (ebx is kept)
+    mov edi, bss_start
+    mov ecx, bss_end
+    sub ecx, edi
+    shr ecx, 2
+    xor eax, eax
+    cld
+    rep stosd
+    
     ; Set up kernel stack
     mov esp, kernel_stack_top
     
-    ; Call the C kernel main function
+    ; Call the C kernel main function with the boot sector's memory map
+    push ebx
     call kernel_main
     
     ; Kernel should never return, but if it does:
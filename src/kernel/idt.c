@@ -0,0 +1,115 @@
+/* idt.c - Interrupt descriptor table and exception dispatch */
+#include "idt.h"
+#include "pic.h"
+#include "thread.h"
+#include "console.h"
+#include "serial.h"
+#include "kprintf.h"
+
+/* Forward declaration of print function */
+void print(const char *str);
+
+/* Gate descriptor */
+typedef struct {
+    unsigned short offset_low;  // Handler address bits 0-15
+    unsigned short selector;    // Code segment selector
+    unsigned char zero;
+    unsigned char type_attr;    // Gate type, DPL and present bit
+    unsigned short offset_high; // Handler address bits 16-31
+} __attribute__((packed)) idt_entry_t;
+
+/* Operand of lidt */
+typedef struct {
+    unsigned short limit;
+    unsigned int base;
+} __attribute__((packed)) idt_ptr_t;
+
+static idt_entry_t idt[IDT_ENTRIES];
+static idt_ptr_t idt_ptr;
+static interrupt_handler_t handlers[IDT_ENTRIES];
+
+/* Exception and IRQ entry stubs (isr.asm) */
+extern void* isr_stub_table[IDT_STUBS];
+
+static const char* exception_names[IDT_EXCEPTIONS] = {
+    "Divide error", "Debug", "NMI", "Breakpoint",
+    "Overflow", "Bound range exceeded", "Invalid opcode", "Device not available",
+    "Double fault", "Coprocessor segment overrun", "Invalid TSS", "Segment not present",
+    "Stack fault", "General protection fault", "Page fault", "Reserved",
+    "x87 floating point error", "Alignment check", "Machine check", "SIMD floating point error",
+    "Virtualization exception", "Control protection exception", "Reserved", "Reserved",
+    "Reserved", "Reserved", "Reserved", "Reserved",
+    "Reserved", "Reserved", "Reserved", "Reserved"
+};
+
+/* Point a vector at a handler as a ring 0 interrupt gate */
+void idt_set_gate(int vector, void* handler) {
+    unsigned int addr = (unsigned int)handler;
+
+    idt[vector].offset_low = addr & 0xFFFF;
+    idt[vector].selector = KERNEL_CODE_SEG;
+    idt[vector].zero = 0;
+    idt[vector].type_attr = IDT_GATE_INT32;
+    idt[vector].offset_high = (addr >> 16) & 0xFFFF;
+}
+
+/* Install a C handler for a vector, replacing the default one */
+void register_interrupt_handler(int vector, interrupt_handler_t handler) {
+    handlers[vector] = handler;
+}
+
+/* Install the exception and IRQ stubs and load the IDT. Interrupts stay
+   off until the PIC is remapped and the caller runs sti. */
+void init_idt() {
+    for (int i = 0; i < IDT_STUBS; i++) {
+        idt_set_gate(i, isr_stub_table[i]);
+    }
+
+    idt_ptr.limit = sizeof(idt) - 1;
+    idt_ptr.base = (unsigned int)idt;
+    idt_load();
+}
+
+/* Point this CPU at the shared IDT - application processors call this
+   once init_idt() has built it */
+void idt_load() {
+    __asm__ volatile("lidt %0" : : "m"(idt_ptr));
+}
+
+/* Common entry from isr.asm - run the registered handler, or report the
+   exception and halt. IRQs are acknowledged here, after their handler,
+   and are where the scheduler preempts the running thread. */
+void isr_handler(interrupt_frame_t* frame) {
+    if (frame->vector >= IRQ_BASE && frame->vector < IRQ_BASE + IRQ_COUNT) {
+        int irq = frame->vector - IRQ_BASE;
+        if (pic_is_spurious(irq)) {
+            return;
+        }
+        if (handlers[frame->vector]) {
+            handlers[frame->vector](frame);
+        }
+        pic_send_eoi(irq);
+        thread_preempt();
+        return;
+    }
+
+    if (handlers[frame->vector]) {
+        handlers[frame->vector](frame);
+        return;
+    }
+
+    print("\nEXCEPTION: ");
+    if (frame->vector < IDT_EXCEPTIONS) {
+        print(exception_names[frame->vector]);
+    } else {
+        print("Unexpected interrupt");
+    }
+    kprintf(" (vector %u, error code %u) at eip %p\nSystem halted.\n",
+            frame->vector, frame->error_code, (void*)frame->eip);
+    console_flush();
+    serial_flush();
+
+    while (1) {
+        __asm__ volatile("cli; hlt");
+    }
+}
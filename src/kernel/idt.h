@@ -0,0 +1,36 @@
+#ifndef IDT_H
+#define IDT_H
+
+/* Interrupt descriptor table */
+#define IDT_ENTRIES      256
+#define IDT_EXCEPTIONS   32         /* Vectors 0-31 are CPU exceptions */
+#define IDT_STUBS        49         /* Exceptions, the 16 PIC lines, one IPI */
+#define IDT_GATE_INT32   0x8E       /* Present, ring 0, 32-bit interrupt gate */
+#define KERNEL_CODE_SEG  0x08       /* Code selector from the boot sector's GDT */
+
+/* Exception vectors */
+#define EXC_DIVIDE_ERROR     0
+#define EXC_INVALID_OPCODE   6
+#define EXC_DOUBLE_FAULT     8
+#define EXC_GENERAL_PROTECT  13
+#define EXC_PAGE_FAULT       14
+
+/* Registers saved by the stubs in isr.asm, lowest address first */
+typedef struct {
+    unsigned int edi, esi, ebp, esp, ebx, edx, ecx, eax;   // pusha
+    unsigned int vector;        // Interrupt vector
+    unsigned int error_code;    // CPU error code, 0 if the vector has none
+    unsigned int eip, cs, eflags;   // Pushed by the CPU
+} interrupt_frame_t;
+
+typedef void (*interrupt_handler_t)(interrupt_frame_t* frame);
+
+/* Function prototypes */
+void init_idt();
+void idt_load();                    /* Load the IDT on this CPU */
+void idt_set_gate(int vector, void* handler);
+void register_interrupt_handler(int vector, interrupt_handler_t handler);
+void isr_handler(interrupt_frame_t* frame);     /* Called from isr.asm */
+void isr_spurious();                /* Bare iret for local APIC spurious interrupts */
+
+#endif /* IDT_H */
@@ -0,0 +1,93 @@
+; isr.asm - Exception and IRQ entry stubs
+; Every stub leaves the same frame (interrupt_frame_t in idt.h) and calls
+; isr_handler in idt.c. Vectors without a CPU error code push a 0.
+; Vectors 32-47 are the remapped PIC lines (pic.h), 48 is the IPI that
+; wakes application processors (smp.h).
+[bits 32]
+[global isr_stub_table]
+[global isr_spurious]
+[extern isr_handler]
+
+section .text
+
+%macro ISR_NOERR 1
+isr_stub_%1:
+    push dword 0                ; No error code
+    push dword %1               ; Vector
+    jmp isr_common
+%endmacro
+
+%macro ISR_ERR 1
+isr_stub_%1:
+    push dword %1               ; Vector, the CPU pushed the error code
+    jmp isr_common
+%endmacro
+
+ISR_NOERR 0
+ISR_NOERR 1
+ISR_NOERR 2
+ISR_NOERR 3
+ISR_NOERR 4
+ISR_NOERR 5
+ISR_NOERR 6
+ISR_NOERR 7
+ISR_ERR   8
+ISR_NOERR 9
+ISR_ERR   10
+ISR_ERR   11
+ISR_ERR   12
+ISR_ERR   13
+ISR_ERR   14
+ISR_NOERR 15
+ISR_NOERR 16
+ISR_ERR   17
+ISR_NOERR 18
+ISR_NOERR 19
+ISR_NOERR 20
+ISR_ERR   21
+ISR_NOERR 22
+ISR_NOERR 23
+ISR_NOERR 24
+ISR_NOERR 25
+ISR_NOERR 26
+ISR_NOERR 27
+ISR_NOERR 28
+ISR_NOERR 29
+ISR_ERR   30
+ISR_NOERR 31
+
+; IRQ 0-15
+%assign i 32
+%rep 16
+isr_stub_%+i:
+    push dword 0                ; No error code
+    push dword i                ; Vector
+    jmp isr_common
+%assign i i + 1
+%endrep
+
+; Inter-processor interrupt
+ISR_NOERR 48
+
+isr_common:
+    pusha
+    cld                         ; C code expects the direction flag clear
+    push esp                    ; interrupt_frame_t*
+    call isr_handler
+    add esp, 4
+    popa
+    add esp, 8                  ; Drop the vector and error code
+    iret
+
+; Local APIC spurious interrupts are not acknowledged, so need no handler
+isr_spurious:
+    iret
+
+section .data
+
+isr_stub_table:
+%assign i 0
+%rep 49
+    dd isr_stub_%+i
+%assign i i + 1
+%endrep
@@ -1,20 +1,43 @@
 /* kernel.c - Main kernel entry point */
 #include "keyboard.h"
 #include "memory.h"  // Add this line
-
-/* Video memory address */
-#define VIDEO_MEMORY 0xB8000
-/* Color: white on black */
-#define COLOR 0x0F
+#include "slab.h"
+#include "string.h"
+#include "idt.h"
+#include "pic.h"
+#include "paging.h"
+#include "memtrack.h"
+#include "arena.h"
+#include "vmalloc.h"
+#include "clock.h"
+#include "cpu.h"
+#include "thread.h"
+#include "smp.h"
+#include "console.h"
+#include "kprintf.h"
+#include "serial.h"
 
 /* Function prototypes - declare these before using them */
-void update_cursor();
 void outb(unsigned short port, unsigned char value);
-int strcmp(const char* str1, const char* str2);
 void execute_command(char* command);
-void scroll_screen();
-void init_vga_cursor();
-void print_int(int num);  // Add this for the integer printing function
+void report_probe(int faulted);
+static int spin_worker(void* arg);
+static int sleep_worker(void* arg);
+
+/* Shell prompt, and the column input starts at after it */
+#define SHELL_PROMPT       "NOX OS> "
+#define SHELL_PROMPT_WIDTH ((int)sizeof(SHELL_PROMPT) - 1)
+
+/* Nap of the page zeroing thread once every free page is zero */
+#define ZERO_THREAD_SLEEP_MS 100
+
+/* threadtest parameters */
+#define THREAD_TEST_SPIN_MS  200
+#define THREAD_TEST_SLEEP_MS 20
+#define THREAD_TEST_SLEEPS   5
+
+/* Scratch memory for the running command - released when it returns */
+static arena_t* command_arena = 0;
 
 /* Debug function prototypes */
 void* page_alloc_debug();
@@ -22,123 +45,12 @@ void* page_alloc_multiple_debug(int count);
 int page_free_debug(void* addr);
 void print_memory_debug_info();
 
-/* Current cursor position */
-int cursor_x = 0;
-int cursor_y = 0;
-
 /* History buffer */
 #define HISTORY_SIZE 5
 static char history[HISTORY_SIZE][256];
 static int history_count = 0;
 static int history_index = 0;
 
-/* Function to write a character to video memory */
-void putchar(char c, int x, int y) {
-    unsigned char *video_memory = (unsigned char*)VIDEO_MEMORY;
-    int offset = (y * 80 + x) * 2;
-    video_memory[offset] = c;
-    video_memory[offset + 1] = COLOR;
-}
-
-/* Function to clear the screen */
-void clear_screen() {
-    unsigned char *video_memory = (unsigned char*)VIDEO_MEMORY;
-    for(int i = 0; i < 80 * 25 * 2; i += 2) {
-        video_memory[i] = ' ';
-        video_memory[i + 1] = COLOR;
-    }
-    cursor_x = 0;
-    cursor_y = 0;
-    update_cursor();  // Update the hardware cursor
-}
-
-/* Function to print a string at specific position */
-void print_string(const char *str, int x, int y) {
-    int i = 0;
-    while(str[i] != '\0') {
-        putchar(str[i], x + i, y);
-        i++;
-    }
-}
-
-/* Print a character at the current cursor position and update cursor */
-void print_char(char c) {
-    if (c == '\n') {
-        cursor_x = 0;
-        cursor_y++;
-    } else if (c == '\b') {
-        // Handle backspace - we need to handle it more simply
-        if (cursor_x > 0) {
-            // Move cursor back one position
-            cursor_x--;
-            
-            // Erase the character (replace with space)
-            putchar(' ', cursor_x, cursor_y);
-        }
-    } else {
-        putchar(c, cursor_x, cursor_y);
-        cursor_x++;
-        
-        // Handle line wrapping
-        if (cursor_x >= 80) {
-            cursor_x = 0;
-            cursor_y++;
-        }
-    }
-    
-    // Check if we need to scroll the screen
-    if (cursor_y >= 25) {
-        scroll_screen();
-        cursor_y = 24; // Keep cursor at the last line
-    }
-    
-    // Update the hardware cursor position
-    update_cursor();
-}
-
-/* Scroll the screen up by one line */
-void scroll_screen() {
-    unsigned char *video_memory = (unsigned char*)VIDEO_MEMORY;
-    
-    // Move each line up one position
-    for (int y = 0; y < 24; y++) {
-        for (int x = 0; x < 80; x++) {
-            int src_offset = ((y + 1) * 80 + x) * 2;
-            int dest_offset = (y * 80 + x) * 2;
-            
-            video_memory[dest_offset] = video_memory[src_offset];
-            video_memory[dest_offset + 1] = video_memory[src_offset + 1];
-        }
-    }
-    
-    // Clear the last line
-    for (int x = 0; x < 80; x++) {
-        int offset = (24 * 80 + x) * 2;
-        video_memory[offset] = ' ';
-        video_memory[offset + 1] = COLOR;
-    }
-}
-
-/* Print a string at the current cursor position */
-void print(const char *str) {
-    int i = 0;
-    while(str[i] != '\0') {
-        print_char(str[i]);
-        i++;
-    }
-}
-
-/* Update the hardware cursor position to match our software cursor */
-void update_cursor() {
-    unsigned short position = (cursor_y * 80) + cursor_x;
-    
-    // Tell the VGA hardware the position
-    outb(0x3D4, 0x0F);  // Low byte register
-    outb(0x3D5, (unsigned char)(position & 0xFF));
-    outb(0x3D4, 0x0E);  // High byte register
-    outb(0x3D5, (unsigned char)((position >> 8) & 0xFF));
-}
-
 /* Write a byte to an I/O port */
 void outb(unsigned short port, unsigned char value) {
     __asm__ volatile("outb %0, %1" : : "a"(value), "dN"(port));
@@ -151,20 +63,11 @@ unsigned char inb(unsigned short port) {
     return ret;
 }
 
-// Command comparison function
-int strcmp(const char* str1, const char* str2) {
-    while(*str1 && (*str1 == *str2)) {
-        str1++;
-        str2++;
-    }
-    return *(unsigned char*)str1 - *(unsigned char*)str2;
-}
-
 // Execute commands
 void execute_command(char* command) {
     if (strcmp(command, "clear") == 0) {
         clear_screen();
-        print("NOX OS> ");
+        print(SHELL_PROMPT);
     }
     else if (strcmp(command, "help") == 0) {
         print("\nAvailable commands:\n");
@@ -176,128 +79,152 @@ void execute_command(char* command) {
         print("  quit     - Shutdown the system\n");
         print("  memprotect - Test memory protection system\n");
         print("  memdebug - Test memory debugging system\n");
-        print("NOX OS> ");
+        print("  memtrack - Toggle kmalloc tracking with red zones\n");
+        print("  memleaks - List live tracked blocks by call site\n");
+        print("  allocbench - Benchmark page allocation\n");
+        print("  protbench - Benchmark protection region lookups\n");
+        print("  vmalloctest - Test virtually contiguous allocations\n");
+        print("  slabtest - Test the small-object allocator\n");
+        print("  realloctest - Test growing and shrinking a buffer\n");
+        print("  strbench - Benchmark memset/memcpy/strlen variants\n");
+        print("  uptime   - Show time since boot and the clock sources\n");
+        print("  time <command> - Run a command and report how long it took\n");
+        print("  ps       - List threads and their CPU time\n");
+        print("  threadtest - Test preemption, sleeping and joining threads\n");
+        print("  smpinfo  - List processors and their local APICs\n");
+        print("  smpbench - Stress page allocation on 1 to N CPUs, with and without magazines\n");
+        print("  consbench - Measure console output speed\n");
+        print("  serial   - Show serial console statistics\n");
+        print("  Shift+PgUp/PgDn - Page through earlier output\n");
+        print(SHELL_PROMPT);
     }
     else if (strcmp(command, "memory") == 0) {
         print_memory_stats();
-        print("\nNOX OS> ");
+        print("\n" SHELL_PROMPT);
     }
     else if (strcmp(command, "memcheck") == 0) {
         print_memory_stats();
+        print_firmware_map();
         print_memory_map();
-        print("\nNOX OS> ");
+        print_vmalloc_info();
+        print("\n" SHELL_PROMPT);
     }
     else if (strcmp(command, "pagetest") == 0) {
         print("\nTesting page allocation system...\n");
         
-        // Allocate single pages
+        // Pages come from the command arena - nothing to free by hand
         print("Allocating 3 individual pages...\n");
-        void* page1 = page_alloc();
-        void* page2 = page_alloc();
-        void* page3 = page_alloc();
-        
-        print("Page 1: ");
-        print_int((unsigned int)page1);
-        print("\nPage 2: ");
-        print_int((unsigned int)page2);
-        print("\nPage 3: ");
-        print_int((unsigned int)page3);
-        print("\n");
+        void* page1 = arena_alloc_aligned(command_arena, PAGE_SIZE, PAGE_SIZE);
+        void* page2 = arena_alloc_aligned(command_arena, PAGE_SIZE, PAGE_SIZE);
+        void* page3 = arena_alloc_aligned(command_arena, PAGE_SIZE, PAGE_SIZE);
         
-        // Allocate multiple pages
-        print("\nAllocating 5 contiguous pages...\n");
-        void* multi_page = page_alloc_multiple(5);
-        print("Multi-page address: ");
-        print_int((unsigned int)multi_page);
-        print("\nPage count: ");
-        print_int(get_page_count(multi_page));
-        print("\n");
+        kprintf("Page 1: %p\nPage 2: %p\nPage 3: %p\n", page1, page2, page3);
+        print_arena_stats(command_arena);
         
-        // Free pages
-        print("\nFreeing allocated pages...\n");
-        page_free(page2);
-        page_free(multi_page);
+        // Allocate multiple pages, remembering where the arena was
+        print("\nAllocating 5 contiguous pages...\n");
+        arena_mark_t mark = arena_mark(command_arena);
+        void* multi_page = arena_alloc_aligned(command_arena, 5 * PAGE_SIZE, PAGE_SIZE);
+        kprintf("Multi-page address: %p\n", multi_page);
+        print_arena_stats(command_arena);
         
-        // Display memory map after allocations and frees
+        // Display memory map while the pages are held
         print_memory_map();
         
-        print("\nNOX OS> ");
+        // Rewind past the 5 pages, the rest goes when the command returns
+        print("\nReleasing the 5 pages...\n");
+        arena_reset(command_arena, mark);
+        print_arena_stats(command_arena);
+        
+        // A DMA buffer must sit below 16 MB and not cross a 64 KB boundary
+        print("\nAllocating a 64 KB DMA buffer...\n");
+        void* dma = page_alloc_aligned(16, 64 * 1024, ZONE_DMA);
+        if (dma) {
+            int placed = ((unsigned int)dma % (64 * 1024)) == 0 &&
+                         (unsigned int)dma + 64 * 1024 <= ZONE_DMA_LIMIT;
+            kprintf("DMA buffer: %p%s\n", dma, placed ? " (aligned, below 16 MB)" : " (WRONG PLACEMENT)");
+            page_free(dma);
+        }
+        
+        print("\n" SHELL_PROMPT);
     }
     else if (strcmp(command, "memprotect") == 0) {
         print("\nTesting memory protection...\n");
         
-        // Allocate a test page
-        void* test_page = page_alloc();
-        print("Allocated test page at: ");
-        print_int((unsigned int)test_page);
-        print("\n");
+        // One page per permission - the page tables work a page at a time
+        unsigned char* addr = (unsigned char*)arena_alloc_aligned(command_arena, 4 * PAGE_SIZE, PAGE_SIZE);
+        if (addr == 0) {
+            print("ERROR: Cannot allocate test pages\n");
+            print("\n" SHELL_PROMPT);
+            return;
+        }
+        kprintf("Allocated 4 test pages at: %p\n", addr);
         
-        // Set different permissions for regions within the page
-        unsigned char* addr = (unsigned char*)test_page;
+        // A ret instruction in each page for the execute probes
+        for (int i = 0; i < 4; i++) {
+            addr[i * PAGE_SIZE] = 0xC3;
+        }
         
-        // First 1KB: Read-only
-        set_memory_permissions(addr, 1024, MEM_PERM_READ);
-        print("Set first 1KB to read-only\n");
+        // First page: Read-only
+        set_memory_permissions(addr, PAGE_SIZE, MEM_PERM_READ);
+        print("Set first page to read-only\n");
         
-        // Next 1KB: Read-write
-        set_memory_permissions(addr + 1024, 1024, MEM_PERM_RW);
-        print("Set next 1KB to read-write\n");
+        // Second page: Read-write
+        set_memory_permissions(addr + PAGE_SIZE, PAGE_SIZE, MEM_PERM_RW);
+        print("Set second page to read-write\n");
         
-        // Next 1KB: Read-execute
-        set_memory_permissions(addr + 2048, 1024, MEM_PERM_RX);
-        print("Set next 1KB to read-execute\n");
+        // Third page: Read-execute
+        set_memory_permissions(addr + 2 * PAGE_SIZE, PAGE_SIZE, MEM_PERM_RX);
+        print("Set third page to read-execute\n");
         
-        // Last 1KB: No permissions
-        set_memory_permissions(addr + 3072, 1024, 0);
-        print("Set last 1KB to no-access\n");
+        // Last page: No permissions
+        set_memory_permissions(addr + 3 * PAGE_SIZE, PAGE_SIZE, 0);
+        print("Set last page to no-access\n");
         
         // Print region information
         print_memory_protection_info();
+        print_paging_info();
         
-        // Test reading from each region
+        // Touch each page for real - the page fault handler catches violations
         print("\nTesting memory access:\n");
         
-        print("Read from read-only region: ");
-        int result = validate_memory_access(addr, 4, MEM_PERM_READ);
-        if (result == MEM_PROT_OK) print("Allowed\n"); else print("Denied\n");
+        print("Read from read-only page: ");
+        report_probe(probe_read(addr));
+        
+        print("Write to read-only page: ");
+        report_probe(probe_write(addr));
         
-        print("Write to read-only region: ");
-        result = validate_memory_access(addr, 4, MEM_PERM_WRITE);
-        if (result == MEM_PROT_OK) print("Allowed\n"); else print("Denied\n");
+        print("Execute from read-only page: ");
+        report_probe(probe_exec(addr));
         
-        print("Execute from read-only region: ");
-        result = validate_memory_access(addr, 4, MEM_PERM_EXEC);
-        if (result == MEM_PROT_OK) print("Allowed\n"); else print("Denied\n");
+        print("Write to read-write page: ");
+        report_probe(probe_write(addr + PAGE_SIZE));
         
-        print("Read from read-write region: ");
-        result = validate_memory_access(addr + 1024, 4, MEM_PERM_READ);
-        if (result == MEM_PROT_OK) print("Allowed\n"); else print("Denied\n");
+        print("Execute from read-write page: ");
+        report_probe(probe_exec(addr + PAGE_SIZE));
         
-        print("Write to read-write region: ");
-        result = validate_memory_access(addr + 1024, 4, MEM_PERM_WRITE);
-        if (result == MEM_PROT_OK) print("Allowed\n"); else print("Denied\n");
+        print("Execute from read-execute page: ");
+        report_probe(probe_exec(addr + 2 * PAGE_SIZE));
         
-        print("Read from no-access region: ");
-        result = validate_memory_access(addr + 3072, 4, MEM_PERM_READ);
-        if (result == MEM_PROT_OK) print("Allowed\n"); else print("Denied\n");
+        print("Read from no-access page: ");
+        report_probe(probe_read(addr + 3 * PAGE_SIZE));
         
-        // Test out-of-bounds access
-        print("Access beyond region boundary: ");
-        result = validate_memory_access(addr + 1020, 8, MEM_PERM_READ);
-        if (result == MEM_PROT_OK) print("Allowed\n"); else print("Denied\n");
+        print("Read through a NULL pointer: ");
+        report_probe(probe_read(0));
         
-        // Free the test page
-        page_free(test_page);
+        if (!paging_has_nx()) {
+            print("(No NX on this CPU - execute permission is not enforced)\n");
+        }
         
-        print("\nNOX OS> ");
+        // Freeing the command arena restores the default mapping
+        
+        print("\n" SHELL_PROMPT);
     }
     else if (strcmp(command, "memdebug") == 0) {
         print("\nTesting memory debugging...\n");
         // Allocate a page
         void* test_page = page_alloc_debug();
-        print("Allocated debug page at: ");
-        print_int((unsigned int)test_page);
-        print("\n");
+        kprintf("Allocated debug page at: %p\n", test_page);
         
         // Print debug info
         print_memory_debug_info();
@@ -308,10 +235,214 @@ void execute_command(char* command) {
         // Print debug info again
         print_memory_debug_info();
         
-        print("\nNOX OS> ");
+        print("\n" SHELL_PROMPT);
+    }
+    else if (strcmp(command, "memtrack") == 0) {
+        if (!memtrack_enable(!memtrack_enabled)) {
+            print("\nERROR: Not enough memory for the tracking table\n");
+        } else {
+            print(memtrack_enabled ? "\nAllocation tracking on\n" : "\nAllocation tracking off\n");
+        }
+        print("\n" SHELL_PROMPT);
+    }
+    else if (strcmp(command, "memleaks") == 0) {
+        print_memory_leaks();
+        print("\n" SHELL_PROMPT);
+    }
+    else if (strcmp(command, "slabtest") == 0) {
+        print("\nTesting slab allocator...\n");
+        
+        // Small kmalloc() requests share pages through the size classes
+        print("Allocating 64 objects of 16 bytes...\n");
+        void* objs[64];
+        for (int i = 0; i < 64; i++) {
+            objs[i] = kmalloc(16);
+        }
+        kprintf("First: %p\nLast: %p\n", objs[0], objs[63]);
+        
+        // A dedicated cache for fixed-size objects
+        kmem_cache_t* cache = kmem_cache_create("test-40", 40);
+        void* obj = kmem_cache_alloc(cache);
+        kprintf("40-byte cache object: %p (%d per slab)\n", obj, cache->objs_per_slab);
+        
+        print_slab_stats();
+        
+        // Free everything
+        print("\nFreeing objects...\n");
+        kmem_cache_free(cache, obj);
+        kmem_cache_destroy(cache);
+        for (int i = 0; i < 64; i++) {
+            kfree(objs[i]);
+        }
+        
+        print_slab_stats();
+        
+        print("\n" SHELL_PROMPT);
+    }
+    else if (strcmp(command, "realloctest") == 0) {
+        print("\nTesting krealloc...\n");
+        
+        // Grow a buffer by doubling, checking the contents survive each step
+        unsigned char* buf = (unsigned char*)kmalloc(16);
+        size_t size = 16;
+        for (size_t i = 0; i < size; i++) buf[i] = (unsigned char)i;
+        
+        while (size < 65536 && buf != 0) {
+            unsigned char* old = buf;
+            size_t old_size = size;
+            size *= 2;
+            buf = (unsigned char*)krealloc(buf, size);
+            if (buf == 0) break;
+            
+            int intact = 1;
+            for (size_t i = 0; i < old_size; i++) {
+                if (buf[i] != (unsigned char)i) intact = 0;
+            }
+            for (size_t i = old_size; i < size; i++) buf[i] = (unsigned char)i;
+            
+            kprintf("  %u bytes: %s, %s\n", size, buf == old ? "in place" : "moved",
+                    intact ? "data intact" : "DATA CORRUPTED");
+        }
+        
+        // Shrink back down - always in place
+        if (buf) {
+            unsigned char* old = buf;
+            buf = (unsigned char*)krealloc(buf, 4096);
+            print("  shrink to 4096 bytes: ");
+            print(buf == old ? "in place\n" : "moved\n");
+            kfree(buf);
+        }
+        
+        print("\n" SHELL_PROMPT);
+    }
+    else if (strcmp(command, "vmalloctest") == 0) {
+        print("\nTesting vmalloc...\n");
+        
+        // 1 MB built from single pages, wherever they happen to be free
+        size_t size = 1024 * 1024;
+        unsigned int* buf = (unsigned int*)vmalloc(size);
+        if (buf == 0) {
+            print("ERROR: vmalloc failed\n");
+            print("\n" SHELL_PROMPT);
+            return;
+        }
+        kprintf("Allocated %u KB at %p (vmalloc offset %u KB)\n", vmalloc_size(buf) / 1024, buf,
+                ((unsigned int)buf - VMALLOC_START) / 1024);
+        
+        // Count the physically contiguous pieces behind it
+        int pieces = 1;
+        for (size_t offset = PAGE_SIZE; offset < size; offset += PAGE_SIZE) {
+            unsigned int prev = paging_get_phys((char*)buf + offset - PAGE_SIZE);
+            if (paging_get_phys((char*)buf + offset) != prev + PAGE_SIZE) {
+                pieces++;
+            }
+        }
+        kprintf("Physical pieces: %d\n", pieces);
+        
+        // Every word should read back through the new mappings
+        for (size_t i = 0; i < size / 4; i++) {
+            buf[i] = i * 2654435761u;
+        }
+        int intact = 1;
+        for (size_t i = 0; i < size / 4; i++) {
+            if (buf[i] != i * 2654435761u) intact = 0;
+        }
+        print(intact ? "Data intact\n" : "DATA CORRUPTED\n");
+        
+        print_vmalloc_info();
+        vfree(buf);
+        print_vmalloc_info();
+        
+        print("\n" SHELL_PROMPT);
+    }
+    else if (strcmp(command, "strbench") == 0) {
+        run_string_benchmark();
+        print("\n" SHELL_PROMPT);
+    }
+    else if (strcmp(command, "allocbench") == 0) {
+        run_alloc_benchmark();
+        print("\n" SHELL_PROMPT);
+    }
+    else if (strcmp(command, "protbench") == 0) {
+        run_region_benchmark();
+        print("\n" SHELL_PROMPT);
+    }
+    else if (strcmp(command, "ps") == 0) {
+        print_threads();
+        print("\n" SHELL_PROMPT);
+    }
+    else if (strcmp(command, "smpinfo") == 0) {
+        print_smp_info();
+        print("\n" SHELL_PROMPT);
+    }
+    else if (strcmp(command, "smpbench") == 0) {
+        run_smp_benchmark();
+        print("\n" SHELL_PROMPT);
+    }
+    else if (strcmp(command, "consbench") == 0) {
+        run_console_benchmark();
+        print("\n" SHELL_PROMPT);
+    }
+    else if (strcmp(command, "serial") == 0) {
+        print_serial_info();
+        print("\n" SHELL_PROMPT);
+    }
+    else if (strcmp(command, "threadtest") == 0) {
+        print("\nTesting threads...\n");
+        kprintf("3 threads spin for %d ms without yielding, a high priority one sleeps meanwhile\n",
+                THREAD_TEST_SPIN_MS);
+        
+        thread_t* spinners[3];
+        unsigned long long start = clock_ns();
+        for (int i = 0; i < 3; i++) {
+            spinners[i] = thread_create("spin", spin_worker, (void*)THREAD_TEST_SPIN_MS, THREAD_PRIO_NORMAL);
+        }
+        thread_t* sleeper = thread_create("sleeper", sleep_worker, (void*)THREAD_TEST_SLEEP_MS, THREAD_PRIO_HIGH);
+        if (spinners[0] == 0 || spinners[1] == 0 || spinners[2] == 0 || sleeper == 0) {
+            print("ERROR: Cannot create the test threads\n");
+        }
+        print_threads();
+        
+        // Each spinner counts how often it got to check the clock - with
+        // fair slices the counts come out close
+        for (int i = 0; i < 3; i++) {
+            if (spinners[i]) {
+                kprintf("Spinner %d: %d loops\n", i, thread_join(spinners[i]));
+            }
+        }
+        if (sleeper) {
+            kprintf("Sleeper woke at most %d us late\n", thread_join(sleeper));
+        }
+        print("Elapsed: ");
+        print_duration(clock_ns() - start);
+        
+        print("\n" SHELL_PROMPT);
+    }
+    else if (strcmp(command, "uptime") == 0) {
+        print_clock_info();
+        print("\n" SHELL_PROMPT);
+    }
+    else if (strncmp(command, "time ", 5) == 0) {
+        unsigned long long start_cycles = clock_cycles();
+        unsigned long long start_ns = clock_ns();
+        execute_command(command + 5);
+        unsigned long long cycles = clock_cycles() - start_cycles;
+        unsigned long long ns = clock_ns() - start_ns;
+        
+        // On a line of its own after whatever the command left - moving
+        // the cursor back over its prompt would only fix the screen, the
+        // serial console has already sent it
+        print("\nreal ");
+        print_duration(ns);
+        if (clock_tsc_khz()) {
+            kprintf(", %llu cycles", cycles);
+        }
+        print("\n" SHELL_PROMPT);
     }
     else if (strcmp(command, "quit") == 0) {
         print("\nShutting down...\n");
+        console_flush();
+        serial_flush();
         // Tell QEMU to power off
         __asm__ volatile("outw %%ax, %%dx" : : "a"((unsigned short)0x2000), "d"((unsigned short)0x604));
         // Backup halt if that fails
@@ -322,136 +453,143 @@ void execute_command(char* command) {
     else if (command[0] != '\0') {
         print("\nUnknown command: ");
         print(command);
-        print("\nNOX OS> ");
+        print("\n" SHELL_PROMPT);
     }
     else {
-        print("\nNOX OS> ");
+        print("\n" SHELL_PROMPT);
     }
 }
 
-/* Initialize VGA cursor */
-void init_vga_cursor() {
-    // Enable cursor, set scanline start/end
-    outb(0x3D4, 0x0A);
-    outb(0x3D5, (inb(0x3D5) & 0xC0) | 0);
-    outb(0x3D4, 0x0B);
-    outb(0x3D5, (inb(0x3D5) & 0xE0) | 0x0F);
+/* Print the outcome of a memory probe */
+void report_probe(int faulted) {
+    if (faulted) {
+        print("Denied - page fault: ");
+        print_last_page_fault();
+        print("\n");
+    } else {
+        print("Allowed\n");
+    }
 }
 
-/* Function to print an integer at the current cursor position */
-void print_int(int num) {
-    char buffer[16];
-    int i = 0;
-    int is_negative = 0;
+/* threadtest: spin for arg milliseconds without yielding, counting loops */
+static int spin_worker(void* arg) {
+    unsigned long long end = clock_ns() + (unsigned int)arg * 1000000ULL;
+    int loops = 0;
     
-    // Handle 0 as a special case
-    if (num == 0) {
-        print("0");
-        return;
+    while (clock_ns() < end) {
+        loops++;
     }
+    return loops;
+}
+
+/* threadtest: sleep arg milliseconds a few times, returning the worst
+   lateness in microseconds */
+static int sleep_worker(void* arg) {
+    unsigned int ms = (unsigned int)arg;
+    unsigned long long worst = 0;
     
-    // Handle negative numbers
-    if (num < 0) {
-        is_negative = 1;
-        num = -num;
+    for (int i = 0; i < THREAD_TEST_SLEEPS; i++) {
+        unsigned long long due = clock_ns() + ms * 1000000ULL;
+        thread_sleep(ms);
+        unsigned long long late = clock_ns() - due;
+        if (late > worst) {
+            worst = late;
+        }
     }
-    
-    // Convert integer to string (in reverse)
-    while (num > 0) {
-        buffer[i++] = '0' + (num % 10);
-        num /= 10;
+    return (int)div64_32(worst, 1000, 0);
+}
+
+/* Page zeroing thread - runs only while the shell waits, and naps once
+   every free page is known to be zero */
+static int zero_main(void* arg) {
+    (void)arg;
+    while (1) {
+        if (page_zero_idle() == 0) {
+            thread_sleep(ZERO_THREAD_SLEEP_MS);
+        }
     }
-    
-    // Add negative sign if needed
-    if (is_negative) {
-        buffer[i++] = '-';
+    return 0;
+}
+
+/* Move the cursor along the input line by dx columns */
+static void shell_cursor_move(int dx) {
+    int x, y;
+    console_get_cursor(&x, &y);
+    console_set_cursor(x + dx, y);
+}
+
+/* Blank the input line from column x on and redraw the command from
+   buffer_pos there, leaving the cursor at x */
+static void shell_redraw_from(const char* command_buffer, int buffer_pos, int x, int y) {
+    for (int i = x; i < CONSOLE_COLS; i++) {
+        putchar(' ', i, y);
     }
-    
-    // Print in correct order (reversing the buffer)
-    while (i > 0) {
-        print_char(buffer[--i]);
+    for (int i = buffer_pos; command_buffer[i] != '\0'; i++) {
+        putchar(command_buffer[i], x + i - buffer_pos, y);
     }
+    console_set_cursor(x, y);
 }
 
-/* Function to handle command input without arrow keys */
-void kernel_main() {
-    init_vga_cursor();
-    clear_screen();
-    
-    print("Welcome to NOX OS!\n");
-    
-    // Initialize memory system
-    init_memory();
-    init_memory_protection();
+/* Shell thread - read a command line and run it */
+static int shell_main(void* arg) {
+    (void)arg;
     
     print("Type 'help' for a list of commands\n\n");
-    print("NOX OS> ");
+    print(SHELL_PROMPT);
     
     char command_buffer[256];
     int buffer_pos = 0;
-    for (int i = 0; i < 256; i++)
-        command_buffer[i] = '\0';
+    memset(command_buffer, 0, sizeof(command_buffer));
     
     while(1) {
         unsigned char key = get_key();
-        if (key != 0) {
+        if (key == 0) {
+            // Show everything up to here, then block until IRQ 1 brings a
+            // key - other threads run meanwhile
+            console_flush();
+            keyboard_wait();
+        }
+        else {
             if (key == KEY_LEFT) {
                 if (buffer_pos > 0) {
                     buffer_pos--;
-                    cursor_x--;
-                    update_cursor();
+                    shell_cursor_move(-1);
                 }
             }
             else if (key == KEY_RIGHT) {
                 if (command_buffer[buffer_pos] != '\0') {
                     buffer_pos++;
-                    cursor_x++;
-                    update_cursor();
+                    shell_cursor_move(1);
                 }
             }
             else if (key == KEY_HOME) {
                 // Go to start of line
+                shell_cursor_move(-buffer_pos);
                 buffer_pos = 0;
-                cursor_x = 8; // After the prompt "NOX OS> "
-                update_cursor();
             }
             else if (key == KEY_END) {
                 // Go to end of current text
-                buffer_pos = 0;
+                int start = buffer_pos;
                 while (command_buffer[buffer_pos] != '\0')
                     buffer_pos++;
-                cursor_x = 8 + buffer_pos;
-                update_cursor();
+                shell_cursor_move(buffer_pos - start);
             }
             else if (key == KEY_UP) {
                 // Show previous command in history
                 if (history_index > 0) {
                     history_index--;
                     
-                    // Clear entire current line first
-                    // Move cursor to beginning of line
-                    cursor_x = 0;
-                    update_cursor();
-                    
-                    // Clear the entire line
-                    for (int i = 0; i < 80; i++) {
-                        putchar(' ', i, cursor_y);
+                    // Clear the entire line and redraw the prompt
+                    int x, y;
+                    console_get_cursor(&x, &y);
+                    for (int i = 0; i < CONSOLE_COLS; i++) {
+                        putchar(' ', i, y);
                     }
-                    
-                    // Redraw the prompt
-                    print_string("NOX OS> ", 0, cursor_y);
-                    
-                    // Reset cursor position
-                    cursor_x = 8; // After the prompt (including the space)
-                    update_cursor();
-                    
-                    // Clear command buffer
-                    for (int i = 0; i < 256; i++) 
-                        command_buffer[i] = '\0';
+                    print_string(SHELL_PROMPT, 0, y);
+                    console_set_cursor(SHELL_PROMPT_WIDTH, y);
                     
                     // Copy from history
-                    for (int i = 0; i < 256; i++)
-                        command_buffer[i] = history[history_index % HISTORY_SIZE][i];
+                    memcpy(command_buffer, history[history_index % HISTORY_SIZE], sizeof(command_buffer));
                     
                     // Print it
                     buffer_pos = 0;
@@ -466,31 +604,21 @@ void kernel_main() {
                 if (history_index < history_count) {
                     history_index++;
                     
-                    // Clear entire current line first
-                    // Move cursor to beginning of line
-                    cursor_x = 0;
-                    update_cursor();
-                    
-                    // Clear the entire line
-                    for (int i = 0; i < 80; i++) {
-                        putchar(' ', i, cursor_y);
+                    // Clear the entire line and redraw the prompt
+                    int x, y;
+                    console_get_cursor(&x, &y);
+                    for (int i = 0; i < CONSOLE_COLS; i++) {
+                        putchar(' ', i, y);
                     }
-                    
-                    // Redraw the prompt
-                    print_string("NOX OS> ", 0, cursor_y);
-                    
-                    // Reset cursor position
-                    cursor_x = 8; // After the prompt (including the space)
-                    update_cursor();
+                    print_string(SHELL_PROMPT, 0, y);
+                    console_set_cursor(SHELL_PROMPT_WIDTH, y);
                     
                     // Clear command buffer
-                    for (int i = 0; i < 256; i++)
-                        command_buffer[i] = '\0';
+                    memset(command_buffer, 0, sizeof(command_buffer));
                     
                     if (history_index < history_count) {
                         // Copy from history
-                        for (int i = 0; i < 256; i++)
-                            command_buffer[i] = history[history_index % HISTORY_SIZE][i];
+                        memcpy(command_buffer, history[history_index % HISTORY_SIZE], sizeof(command_buffer));
                     }
                     
                     // Print it (might be empty if we went past the end of history)
@@ -505,30 +633,12 @@ void kernel_main() {
                 // Delete the character at the current cursor position
                 if (command_buffer[buffer_pos] != '\0') {
                     // Shift all characters after cursor to the left
-                    for (int i = buffer_pos; i < 255; i++) {
-                        command_buffer[i] = command_buffer[i+1];
-                    }
-                    
-                    // Clear the rest of the line
-                    int current_x = cursor_x;
-                    for (int i = current_x; i < 80; i++) {
-                        putchar(' ', i, cursor_y);
-                    }
-                    
-                    // Redraw from current position
-                    int temp_pos = buffer_pos;
-                    cursor_x = current_x;
-                    update_cursor();
+                    memmove(command_buffer + buffer_pos, command_buffer + buffer_pos + 1, 255 - buffer_pos);
                     
-                    while (command_buffer[temp_pos] != '\0') {
-                        putchar(command_buffer[temp_pos], cursor_x, cursor_y);
-                        temp_pos++;
-                        cursor_x++;
-                    }
-                    
-                    // Reset cursor to the correct position
-                    cursor_x = current_x;
-                    update_cursor();
+                    // Redraw the rest of the line from the cursor
+                    int x, y;
+                    console_get_cursor(&x, &y);
+                    shell_redraw_from(command_buffer, buffer_pos, x, y);
                 }
             }
             else if (key == '\n') {
@@ -536,16 +646,18 @@ void kernel_main() {
                 
                 // Store in history - we'll use the full command
                 if (buffer_pos > 0 || command_buffer[0] != '\0') {
-                    for(int i=0; i<256; i++)
-                        history[history_count % HISTORY_SIZE][i] = command_buffer[i];
+                    memcpy(history[history_count % HISTORY_SIZE], command_buffer, sizeof(command_buffer));
                     history_count++;
                     history_index = history_count;
                 }
                 
+                // Everything the command took from its arena goes back in one step
+                command_arena = arena_create(ARENA_CHUNK_PAGES);
                 execute_command(command_buffer);
+                arena_destroy(command_arena);
+                command_arena = 0;
                 buffer_pos = 0;
-                for (int i = 0; i < 256; i++)
-                    command_buffer[i] = '\0';
+                memset(command_buffer, 0, sizeof(command_buffer));
             }
             else if (key == '\b') {
                 if (buffer_pos > 0) {
@@ -553,43 +665,25 @@ void kernel_main() {
                     buffer_pos--;
                     
                     // Shift all characters to the left
-                    for (int i = buffer_pos; i < 255; i++) {
-                        command_buffer[i] = command_buffer[i+1];
-                    }
-                    
-                    // Move cursor back visually
-                    cursor_x--;
-                    update_cursor();
+                    memmove(command_buffer + buffer_pos, command_buffer + buffer_pos + 1, 255 - buffer_pos);
                     
-                    // Clear the rest of the line
-                    int current_x = cursor_x;
-                    for (int i = current_x; i < 80; i++) {
-                        putchar(' ', i, cursor_y);
+                    // The redraw below is screen only - a terminal on the
+                    // serial console can follow a backspace at the end
+                    if (command_buffer[buffer_pos] == '\0') {
+                        serial_write("\b", 1);
                     }
                     
-                    // Redraw from current position
-                    int temp_pos = buffer_pos;
-                    cursor_x = current_x;
-                    update_cursor();
-                    
-                    while (command_buffer[temp_pos] != '\0') {
-                        putchar(command_buffer[temp_pos], cursor_x, cursor_y);
-                        temp_pos++;
-                        cursor_x++;
-                    }
-                    
-                    // Reset cursor to the correct position
-                    cursor_x = current_x;
-                    update_cursor();
+                    // Move back one column and redraw the rest of the line
+                    int x, y;
+                    console_get_cursor(&x, &y);
+                    shell_redraw_from(command_buffer, buffer_pos, x - 1, y);
                 }
             }
             // Only handle normal ASCII characters (32-126) for typing
             else if (key >= 32 && key <= 126) {
                 if (buffer_pos < 255) {
                     // Make room for the new character by shifting everything right
-                    for (int i = 255; i > buffer_pos; i--) {
-                        command_buffer[i] = command_buffer[i-1];
-                    }
+                    memmove(command_buffer + buffer_pos + 1, command_buffer + buffer_pos, 255 - buffer_pos);
                     
                     // Insert the character
                     command_buffer[buffer_pos] = key;
@@ -606,12 +700,54 @@ void kernel_main() {
                     }
                     
                     // Move cursor back to correct position
-                    for (int i = temp_pos; i > buffer_pos; i--) {
-                        cursor_x--;
-                        update_cursor();
-                    }
+                    shell_cursor_move(buffer_pos - temp_pos);
                 }
             }
         }
     }
+    return 0;
+}
+
+/* Kernel entry point.
+   map is the BIOS memory map collected by the boot sector. */
+void kernel_main(e820_map_t* map) {
+    // Pick the memset/memcpy variants before anything uses them
+    init_string();
+    
+    // Exceptions report themselves instead of triple faulting
+    init_idt();
+    
+    // Keys arrive by interrupt from here on
+    init_pic();
+    init_keyboard();
+    // Headless runs (-serial stdio) see the console and can type into it
+    init_serial();
+    // Calibrates the TSC, so before interrupts can stretch the measurement
+    init_clock();
+    __asm__ volatile("sti");
+    
+    init_console();
+    
+    print("Welcome to NOX OS!\n");
+    
+    // Initialize memory system
+    init_memory(map);
+    // The ACPI search reads page 0, which paging leaves unmapped
+    smp_detect();
+    init_memory_protection();
+    // Output from here on can be paged back with Shift+PgUp
+    console_init_scrollback(CONSOLE_SCROLLBACK_LINES);
+    
+    // Application processors wait for work; threads stay on this CPU
+    init_smp();
+    
+    // The boot stack becomes the idle thread; the shell and page zeroing
+    // get threads of their own and are preempted by the timer
+    init_threads();
+    thread_create("shell", shell_main, 0, THREAD_PRIO_NORMAL);
+    thread_create("zero", zero_main, 0, THREAD_PRIO_LOW);
+    
+    while (1) {
+        __asm__ volatile("hlt");
+    }
 }
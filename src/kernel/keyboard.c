@@ -1,4 +1,10 @@
 #include "keyboard.h"
+#include "idt.h"
+#include "pic.h"
+#include "thread.h"
+#include "cpu.h"
+#include "console.h"
+#include "serial.h"
 
 // Define keyboard I/O ports
 #define KEYBOARD_DATA_PORT 0x60
@@ -7,11 +13,23 @@
 /* Keyboard modifier states */
 static int shift_pressed = 0;
 static int capslock_enabled = 0;
+static int extended_pending = 0;    // 0xE0 seen, the next byte is an extended key
+
+/* Scancodes waiting to be translated. The IRQ 1 handler is the only
+   writer of ring_head and get_key() the only writer of ring_tail, so
+   neither side needs a lock. One slot stays empty to tell full from empty. */
+static volatile unsigned char ring[KEYBOARD_RING_SIZE];
+static volatile unsigned int ring_head = 0;     // Next slot the handler fills
+static volatile unsigned int ring_tail = 0;     // Next slot get_key() reads
+static unsigned int ring_dropped = 0;           // Scancodes lost to a full ring
+static thread_t* waiter = 0;                    // Thread blocked in keyboard_wait()
 
 /* Special scan codes */
 #define SCAN_LEFT_SHIFT  0x2A
 #define SCAN_RIGHT_SHIFT 0x36
 #define SCAN_CAPS_LOCK   0x3A
+#define SCAN_PAGE_UP     0x49       /* After 0xE0 */
+#define SCAN_PAGE_DOWN   0x51       /* After 0xE0 */
 
 /* This table maps scan codes to ASCII characters (unshifted) */
 static unsigned char scancode_to_ascii[] = {
@@ -33,30 +51,99 @@ static unsigned char scancode_to_ascii_shifted[] = {
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
 };
 
-/* Get a key from the keyboard */
-unsigned char get_key() {
-    if (inb(KEYBOARD_STATUS_PORT) & 0x01) {
-        unsigned char scan_code = inb(KEYBOARD_DATA_PORT);
-        
-        // Handle special keys (shift, caps lock)
-        if (scan_code == SCAN_LEFT_SHIFT || scan_code == SCAN_RIGHT_SHIFT) {
-            shift_pressed = 1;
-            return 0; // Don't return shift as a character
-        }
-        else if ((scan_code == (SCAN_LEFT_SHIFT + 0x80)) || (scan_code == (SCAN_RIGHT_SHIFT + 0x80))) {
-            shift_pressed = 0;
-            return 0; // Don't return shift release as a character
-        }
-        else if (scan_code == SCAN_CAPS_LOCK) {
-            capslock_enabled = !capslock_enabled; // Toggle caps lock state
-            return 0; // Don't return caps lock as a character
+/* IRQ 1 - queue the scancode, translation happens outside the interrupt */
+static void keyboard_irq(interrupt_frame_t* frame) {
+    (void)frame;
+    unsigned char scan_code = inb(KEYBOARD_DATA_PORT);
+    unsigned int next = (ring_head + 1) % KEYBOARD_RING_SIZE;
+    
+    if (next == ring_tail) {
+        ring_dropped++;
+        return;
+    }
+    ring[ring_head] = scan_code;
+    // The scancode must be stored before the consumer can see the new head
+    __asm__ volatile("" : : : "memory");
+    ring_head = next;
+    
+    if (waiter) {
+        thread_wake(waiter);
+    }
+}
+
+/* Take over IRQ 1. Call with interrupts off, before sti. */
+void init_keyboard() {
+    // Drop anything the controller buffered while we were polling
+    while (inb(KEYBOARD_STATUS_PORT) & 0x01) {
+        inb(KEYBOARD_DATA_PORT);
+    }
+    
+    register_interrupt_handler(IRQ_BASE + IRQ_KEYBOARD, keyboard_irq);
+    pic_unmask(IRQ_KEYBOARD);
+}
+
+/* Whether scancodes, or bytes from the serial console, are waiting */
+int keyboard_has_input() {
+    return ring_head != ring_tail || serial_has_input();
+}
+
+/* Wake the thread in keyboard_wait() - for interrupts of other input
+   sources */
+void keyboard_notify() {
+    if (waiter) {
+        thread_wake(waiter);
+    }
+}
+
+/* Scancodes lost because the ring was full */
+unsigned int keyboard_dropped() {
+    return ring_dropped;
+}
+
+/* Sleep until a scancode arrives - blocking the calling thread once
+   threads run, before that halting. Interrupts stay off from the check
+   until we sleep, so the IRQ cannot slip in between. */
+void keyboard_wait() {
+    unsigned int flags = irq_save();
+    while (!keyboard_has_input()) {
+        if (thread_current()) {
+            waiter = thread_current();
+            thread_block();
+        } else {
+            // sti only takes effect after the next instruction
+            __asm__ volatile("sti; hlt; cli");
         }
+    }
+    waiter = 0;
+    irq_restore(flags);
+}
+
+/* Next queued scancode, or -1 */
+static int ring_pop() {
+    if (ring_tail == ring_head) {
+        return -1;
+    }
+    unsigned char scan_code = ring[ring_tail];
+    // Read the slot before handing it back to the handler
+    __asm__ volatile("" : : : "memory");
+    ring_tail = (ring_tail + 1) % KEYBOARD_RING_SIZE;
+    return scan_code;
+}
+
+/* Get a key from the keyboard - 0 if none is waiting */
+unsigned char get_key() {
+    int next = ring_pop();
+    if (next != -1) {
+        unsigned char scan_code = (unsigned char)next;
         
-        // Handle extended scan codes (arrow keys, etc.)
+        // Handle extended scan codes (arrow keys, etc.) - the prefix and
+        // the key arrive as separate interrupts
         if (scan_code == 0xE0) {
-            // Wait for the next byte
-            while (!(inb(KEYBOARD_STATUS_PORT) & 0x01));
-            scan_code = inb(KEYBOARD_DATA_PORT);
+            extended_pending = 1;
+            return 0;
+        }
+        if (extended_pending) {
+            extended_pending = 0;
             
             // Map extended scan codes to our defined values above ASCII range
             switch (scan_code) {
@@ -67,10 +154,33 @@ unsigned char get_key() {
                 case 0x47: return KEY_HOME;   // 0x84
                 case 0x4F: return KEY_END;    // 0x85
                 case 0x53: return KEY_DELETE; // 0x7F
+                case SCAN_PAGE_UP:
+                case SCAN_PAGE_DOWN:
+                    // Shift+PgUp/PgDn page through the scrollback here,
+                    // so every reader of keys gets it for free
+                    if (shift_pressed) {
+                        console_scroll_view(scan_code == SCAN_PAGE_UP ?
+                                            CONSOLE_PAGE_LINES : -CONSOLE_PAGE_LINES);
+                    }
+                    return 0;
                 default: return 0;
             }
         }
         
+        // Handle special keys (shift, caps lock)
+        if (scan_code == SCAN_LEFT_SHIFT || scan_code == SCAN_RIGHT_SHIFT) {
+            shift_pressed = 1;
+            return 0; // Don't return shift as a character
+        }
+        else if ((scan_code == (SCAN_LEFT_SHIFT + 0x80)) || (scan_code == (SCAN_RIGHT_SHIFT + 0x80))) {
+            shift_pressed = 0;
+            return 0; // Don't return shift release as a character
+        }
+        else if (scan_code == SCAN_CAPS_LOCK) {
+            capslock_enabled = !capslock_enabled; // Toggle caps lock state
+            return 0; // Don't return caps lock as a character
+        }
+        
         // Regular key processing
         if (scan_code < 0x80) { // Key press
             // Handle alphabetic keys (a-z, A-Z) based on caps lock and shift
@@ -94,13 +204,15 @@ unsigned char get_key() {
             }
         }
     }
-    return 0; // No key
+    // Then keys typed on the serial console
+    return serial_get_key();
 }
 
 // Wait until a key is pressed and return its ASCII value
 unsigned char wait_for_key() {
     unsigned char c = 0;
     while (c == 0) {
+        keyboard_wait();
         c = get_key();
     }
     return c;
@@ -14,8 +14,16 @@
 #define KEY_HOME    0x84    /* Above normal ASCII */
 #define KEY_END     0x85    /* Above normal ASCII */
 
+/* Scancodes buffered between IRQ 1 and get_key() */
+#define KEYBOARD_RING_SIZE 256
+
 /* Function prototypes */
-unsigned char get_key();
+void init_keyboard();               /* Install the IRQ 1 handler */
+unsigned char get_key();            /* 0 if no key is waiting */
+int keyboard_has_input();
+void keyboard_wait();               /* Block until a scancode arrives */
+void keyboard_notify();             /* Input arrived elsewhere - interrupts off */
+unsigned int keyboard_dropped();
 unsigned char inb(unsigned short port);
 
 #endif /* KEYBOARD_H */
\ No newline at end of file
@@ -0,0 +1,219 @@
+/* kprintf.c - Formatted output into a buffer or to the console */
+#include "kprintf.h"
+#include "console.h"
+#include "cpu.h"
+
+/* Where formatted characters go */
+typedef struct {
+    char* buffer;
+    size_t size;
+    size_t used;
+    int total;                  // Characters produced, kept or not
+    int to_console;             // Write the buffer out when full instead of dropping
+} kprintf_out_t;
+
+/* Add one character, keeping a byte for the terminator */
+static void out_char(kprintf_out_t* out, char c) {
+    if (out->used + 1 >= out->size && out->to_console) {
+        console_write(out->buffer, out->used);
+        out->used = 0;
+    }
+    if (out->used + 1 < out->size) {
+        out->buffer[out->used++] = c;
+    }
+    out->total++;
+}
+
+static void out_pad(kprintf_out_t* out, char c, int count) {
+    while (count-- > 0) {
+        out_char(out, c);
+    }
+}
+
+/* A string padded to width - on the left unless left aligned */
+static void out_string(kprintf_out_t* out, const char* str, int width, int left) {
+    int length = 0;
+    while (str[length]) {
+        length++;
+    }
+
+    if (!left) {
+        out_pad(out, ' ', width - length);
+    }
+    for (int i = 0; i < length; i++) {
+        out_char(out, str[i]);
+    }
+    if (left) {
+        out_pad(out, ' ', width - length);
+    }
+}
+
+/* A number in base 10 or 16. Zero padding goes after the sign. */
+static void out_number(kprintf_out_t* out, unsigned long long value, int base, int upper,
+                       int negative, int width, int left, int zero) {
+    const char* digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    char buffer[24];
+    int length = 0;
+
+    if (base == 16) {
+        do {
+            buffer[length++] = digits[value & 0xF];
+            value >>= 4;
+        } while (value);
+    } else if (value >> 32) {
+        // No libgcc for 64-bit division
+        unsigned int digit;
+        do {
+            value = div64_32(value, 10, &digit);
+            buffer[length++] = '0' + digit;
+        } while (value);
+    } else {
+        unsigned int small = (unsigned int)value;
+        do {
+            buffer[length++] = '0' + small % 10;
+            small /= 10;
+        } while (small);
+    }
+
+    int pad = width - length - negative;
+    if (!left && !zero) {
+        out_pad(out, ' ', pad);
+    }
+    if (negative) {
+        out_char(out, '-');
+    }
+    if (!left && zero) {
+        out_pad(out, '0', pad);
+    }
+    while (length > 0) {
+        out_char(out, buffer[--length]);
+    }
+    if (left) {
+        out_pad(out, ' ', pad);
+    }
+}
+
+/* Format into out, one conversion at a time */
+static void format(kprintf_out_t* out, const char* fmt, va_list args) {
+    while (*fmt) {
+        if (*fmt != '%') {
+            out_char(out, *fmt++);
+            continue;
+        }
+        fmt++;
+
+        int left = 0;
+        int zero = 0;
+        for (;; fmt++) {
+            if (*fmt == '-') {
+                left = 1;
+            } else if (*fmt == '0') {
+                zero = 1;
+            } else {
+                break;
+            }
+        }
+
+        int width = 0;
+        while (*fmt >= '0' && *fmt <= '9') {
+            width = width * 10 + (*fmt++ - '0');
+        }
+
+        int longs = 0;
+        while (*fmt == 'l') {
+            longs++;
+            fmt++;
+        }
+
+        switch (*fmt) {
+            case 'd':
+            case 'i': {
+                long long value;
+                if (longs >= 2) {
+                    value = va_arg(args, long long);
+                } else if (longs == 1) {
+                    value = va_arg(args, long);
+                } else {
+                    value = va_arg(args, int);
+                }
+                unsigned long long magnitude = value < 0 ? -(unsigned long long)value : (unsigned long long)value;
+                out_number(out, magnitude, 10, 0, value < 0, width, left, zero);
+                break;
+            }
+            case 'u':
+            case 'x':
+            case 'X': {
+                unsigned long long value;
+                if (longs >= 2) {
+                    value = va_arg(args, unsigned long long);
+                } else if (longs == 1) {
+                    value = va_arg(args, unsigned long);
+                } else {
+                    value = va_arg(args, unsigned int);
+                }
+                out_number(out, value, *fmt == 'u' ? 10 : 16, *fmt == 'X', 0, width, left, zero);
+                break;
+            }
+            case 'p':
+                out_char(out, '0');
+                out_char(out, 'x');
+                out_number(out, (unsigned int)(unsigned long)va_arg(args, void*), 16, 1, 0, 8, 0, 1);
+                break;
+            case 's': {
+                const char* str = va_arg(args, const char*);
+                out_string(out, str ? str : "(null)", width, left);
+                break;
+            }
+            case 'c':
+                out_char(out, (char)va_arg(args, int));
+                break;
+            case '%':
+                out_char(out, '%');
+                break;
+            case '\0':
+                return;
+            default:
+                // Unknown conversion - show it as written
+                out_char(out, '%');
+                out_char(out, *fmt);
+                break;
+        }
+        fmt++;
+    }
+}
+
+/* Format into buffer, truncating to size - 1 characters. Returns the
+   length the whole output would have had. */
+int kvsnprintf(char* buffer, size_t size, const char* fmt, va_list args) {
+    kprintf_out_t out = { buffer, size, 0, 0, 0 };
+
+    format(&out, fmt, args);
+    if (size > 0) {
+        buffer[out.used] = '\0';
+    }
+    return out.total;
+}
+
+int ksnprintf(char* buffer, size_t size, const char* fmt, ...) {
+    va_list args;
+
+    va_start(args, fmt);
+    int length = kvsnprintf(buffer, size, fmt, args);
+    va_end(args);
+    return length;
+}
+
+/* Format on the stack and write to the console a buffer at a time,
+   rather than a call per character */
+void kprintf(const char* fmt, ...) {
+    char buffer[KPRINTF_BUFFER];
+    kprintf_out_t out = { buffer, sizeof(buffer), 0, 0, 1 };
+    va_list args;
+
+    va_start(args, fmt);
+    format(&out, fmt, args);
+    va_end(args);
+    if (out.used > 0) {
+        console_write(buffer, out.used);
+    }
+}
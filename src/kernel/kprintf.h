@@ -0,0 +1,24 @@
+#ifndef KPRINTF_H
+#define KPRINTF_H
+
+#include "memory.h"
+
+/* No stdarg.h without the C library - the compiler provides varargs */
+typedef __builtin_va_list va_list;
+#define va_start(ap, last) __builtin_va_start(ap, last)
+#define va_arg(ap, type)   __builtin_va_arg(ap, type)
+#define va_end(ap)         __builtin_va_end(ap)
+
+/* kprintf() formats into a buffer of this size on its stack and hands
+   each full buffer to the console as one string */
+#define KPRINTF_BUFFER 128
+
+/* Conversions: %d %i %u %x %X %p %s %c %%, with the flags '-' and '0',
+   a field width, and the l and ll length modifiers (ll: 64-bit).
+   %p is 0x and 8 upper case hex digits. */
+void kprintf(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+int ksnprintf(char* buffer, size_t size, const char* fmt, ...)     /* Length it wanted */
+    __attribute__((format(printf, 3, 4)));
+int kvsnprintf(char* buffer, size_t size, const char* fmt, va_list args);
+
+#endif /* KPRINTF_H */
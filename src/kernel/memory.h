@@ -7,8 +7,47 @@ typedef unsigned int size_t;
 /* Memory constants */
 #define PAGE_SIZE 4096                  /* 4KB pages */
 #define HEAP_START 0x100000             /* Start at 1MB */
-#define HEAP_INITIAL_SIZE 0x100000      /* 1MB initial heap */
-#define BITMAP_SIZE (HEAP_INITIAL_SIZE / PAGE_SIZE / 8)  /* Bitmap size in bytes */
+#define HEAP_INITIAL_SIZE 0x100000      /* Heap assumed when the BIOS gives no memory map */
+
+/* Kernel virtual range for vmalloc() - RAM is only identity mapped below it */
+#define VMALLOC_START 0xD0000000
+#define VMALLOC_SIZE  0x10000000        /* 256 MB */
+
+/* BIOS memory map (INT 15h, E820) left by the boot sector */
+#define E820_MAP_ADDR    0x500          /* Entry count followed by the entries */
+#define E820_MAX_ENTRIES 32
+
+/* E820 range types */
+#define E820_USABLE       1
+#define E820_RESERVED     2
+#define E820_ACPI_RECLAIM 3
+#define E820_ACPI_NVS     4
+#define E820_BAD          5
+
+/* Page allocation flags */
+#define PAGE_NOZERO 0x01                /* Caller overwrites the pages anyway */
+
+/* Allocation zones */
+#define ZONE_DMA        0               /* Below ZONE_DMA_LIMIT, reachable by ISA DMA */
+#define ZONE_NORMAL     1               /* Everything else */
+#define MEM_ZONES       2
+#define ZONE_DMA_LIMIT  0x1000000       /* 16 MB */
+
+/* Free pages zeroed per idle loop pass */
+#define ZERO_IDLE_BATCH 4
+
+/* Per-CPU page magazines - single pages are cached per CPU and moved to
+   and from the buddy allocator a batch at a time. The batch doubles while
+   other CPUs hold the allocator lock and halves once it has gone quiet. */
+#define PAGE_MAG_CAPACITY     64
+#define PAGE_MAG_BATCH_MIN    4
+#define PAGE_MAG_BATCH_MAX    32
+#define PAGE_MAG_SHRINK_AFTER 64      /* Uncontended refills and drains before halving */
+#define PAGE_MAG_SEARCH       8       /* Top pages searched for a zeroed or, for PAGE_NOZERO, dirty one */
+
+/* Free-run length classes in mem_stats_t: class k counts runs of
+   2^k to 2^(k+1)-1 pages, enough for 4 GB */
+#define MEM_RUN_CLASSES 21
 
 /* Memory allocation error codes */
 #define MEM_OK 0
@@ -29,6 +68,7 @@ typedef unsigned int size_t;
 #define MEM_PROT_INVALID_ADDR  1
 #define MEM_PROT_PERM_DENIED   2
 #define MEM_PROT_OUT_OF_BOUNDS 3
+#define MEM_PROT_NO_MEM        4
 
 /* Memory region structure */
 typedef struct {
@@ -37,20 +77,75 @@ typedef struct {
     unsigned char perm; // Permissions (read/write/exec)
 } mem_region_t;
 
+/* One range of the BIOS memory map */
+typedef struct {
+    unsigned long long base;    // Physical start address
+    unsigned long long length;  // Length in bytes
+    unsigned int type;          // E820_USABLE, E820_RESERVED, ...
+    unsigned int acpi;          // ACPI 3.0 extended attributes
+} __attribute__((packed)) e820_entry_t;
+
+/* Memory map as stored at E820_MAP_ADDR */
+typedef struct {
+    unsigned int count;
+    e820_entry_t entries[E820_MAX_ENTRIES];
+} __attribute__((packed)) e820_map_t;
+
+/* Allocator statistics, maintained as pages are allocated and freed */
+typedef struct {
+    unsigned int total_pages;       // Usable pages managed by the allocator
+    unsigned int used_pages;
+    unsigned int free_pages;
+    unsigned int zeroed_pages;      // Free pages already zeroed
+    unsigned int free_runs;         // Maximal runs of contiguous free pages
+    unsigned int run_histogram[MEM_RUN_CLASSES];    // Free runs per log2 length class
+    int largest_run_class;          // Class of the longest free run, -1 if none
+    int largest_block_order;        // Largest free buddy block, -1 if none
+    unsigned int zero_hits;         // Allocated pages that were pre-zeroed
+    unsigned int zero_misses;       // Allocated pages zeroed on the spot
+    unsigned int zero_skipped;      // Allocated pages with PAGE_NOZERO
+    unsigned int zero_wasted;       // PAGE_NOZERO pages that used up a pre-zeroed one
+    unsigned int zone_total[MEM_ZONES];     // Usable pages per zone
+    unsigned int zone_free[MEM_ZONES];      // Free pages per zone
+    int zone_largest_order[MEM_ZONES];      // Largest free buddy block per zone, -1 if none
+    unsigned int zone_fallbacks;    // ZONE_NORMAL requests served from ZONE_DMA
+    unsigned int magazine_pages;    // Free pages cached per CPU (counted as free)
+    unsigned int magazine_hits;     // Single pages handed out from a magazine
+    unsigned int magazine_misses;   // Single page requests that found it empty
+    unsigned int magazine_frees;    // Single pages freed into a magazine
+    unsigned int magazine_refills;  // Batches taken from the buddy allocator
+    unsigned int magazine_drains;   // Batches given back to it
+    unsigned int magazine_contended;    // Refills and drains that found the lock held
+} mem_stats_t;
+
 /* Function prototypes */
-void init_memory();
+void init_memory(e820_map_t* map);
 void* kmalloc(size_t size);
 void kfree(void* ptr);
 void* krealloc(void* ptr, size_t size);
+size_t ksize(void* ptr);
+void mem_get_stats(mem_stats_t* stats);     /* O(1) snapshot, prints nothing */
 void print_memory_stats();
 void print_memory_map();
+void print_firmware_map();
 
 /* Page allocation functions */
 void* page_alloc();                  /* Allocate a single page */
 void* page_alloc_multiple(int count);/* Allocate multiple contiguous pages */
+void* page_alloc_flags(int count, int flags); /* Allocate pages, PAGE_NOZERO = skip zeroing */
+void* page_alloc_aligned(int count, size_t align, int zone); /* align: power of two, in bytes */
+int page_zero_idle();                /* Pre-zero free pages, returns pages zeroed */
+int page_magazines_enable(int on);   /* Off empties them; returns the previous setting */
 int page_free(void* addr);           /* Free a page or pages */
 int page_is_allocated(void* addr);   /* Check if a page is allocated */
 int get_page_count(void* addr);      /* Get number of pages for an allocation */
+int get_total_pages();               /* Pages of physical address space tracked */
+void page_set_owner(void* addr, void* owner); /* Tag an allocation's pages */
+void* page_get_owner(void* addr);    /* Owner tag of the page containing addr */
+
+/* Benchmark */
+void run_alloc_benchmark();          /* Time page allocation, print cycles per call */
+void run_region_benchmark();         /* Time protection region lookups */
 
 /* Memory protection function prototypes */
 void init_memory_protection();
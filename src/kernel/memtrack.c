@@ -0,0 +1,229 @@
+/* memtrack.c - Optional kmalloc() tracking with red zones and leak reports */
+#include "memtrack.h"
+#include "string.h"
+#include "spinlock.h"
+#include "kprintf.h"
+
+/* One live tracked block */
+typedef struct memtrack_entry {
+    void* ptr;                      // Address handed to the caller
+    void* caller;                   // Return address of the kmalloc() call
+    size_t size;                    // Requested bytes
+    unsigned int seq;               // Allocation sequence number
+    struct memtrack_entry* next;    // Next entry in the same bucket, or on the free list
+} memtrack_entry_t;
+
+/* Live allocations grouped by call site */
+typedef struct {
+    void* caller;
+    int blocks;
+    size_t bytes;
+    unsigned int oldest;            // Lowest sequence number
+} memtrack_site_t;
+
+int memtrack_enabled = 0;
+int memtrack_live = 0;
+
+static memtrack_entry_t** buckets;
+static memtrack_entry_t* free_entries;
+static unsigned int next_seq = 0;
+static unsigned int dropped = 0;            // Blocks left untracked, table full
+static unsigned int redzone_errors = 0;
+static spinlock_t memtrack_lock = SPINLOCK_INIT;   // Guards the table and counters
+
+/* Bucket for an address - multiplicative hash of the 8-byte granule */
+static inline unsigned int bucket_of(void* ptr) {
+    return (((unsigned int)ptr >> 3) * 2654435761u) % MEMTRACK_BUCKETS;
+}
+
+/* Allocate the table on first use and switch tracking on or off.
+   Blocks tracked earlier stay tracked until freed. */
+int memtrack_enable(int on) {
+    unsigned int flags = spin_lock_irqsave(&memtrack_lock);
+    if (on && buckets == 0) {
+        size_t bytes = MEMTRACK_BUCKETS * sizeof(memtrack_entry_t*) +
+                       MEMTRACK_MAX_ENTRIES * sizeof(memtrack_entry_t);
+        unsigned char* table = (unsigned char*)page_alloc_multiple((bytes + PAGE_SIZE - 1) / PAGE_SIZE);
+        if (table == 0) {
+            spin_unlock_irqrestore(&memtrack_lock, flags);
+            return 0;
+        }
+
+        // Buckets start out empty (zeroed pages), entries all go on the free list
+        buckets = (memtrack_entry_t**)table;
+        memtrack_entry_t* entries = (memtrack_entry_t*)(buckets + MEMTRACK_BUCKETS);
+        for (int i = 0; i < MEMTRACK_MAX_ENTRIES; i++) {
+            entries[i].next = free_entries;
+            free_entries = &entries[i];
+        }
+    }
+
+    memtrack_enabled = on;
+    spin_unlock_irqrestore(&memtrack_lock, flags);
+    return 1;
+}
+
+/* Record a block of size + 2 * MEMTRACK_REDZONE bytes and fill its red
+   zones. Returns the address for the caller, or 0 if the table is full. */
+void* memtrack_add(void* block, size_t size, void* caller) {
+    unsigned int flags = spin_lock_irqsave(&memtrack_lock);
+    memtrack_entry_t* entry = free_entries;
+    if (entry == 0) {
+        dropped++;
+        spin_unlock_irqrestore(&memtrack_lock, flags);
+        return 0;
+    }
+    free_entries = entry->next;
+
+    unsigned char* ptr = (unsigned char*)block + MEMTRACK_REDZONE;
+    memset(block, MEMTRACK_REDZONE_BYTE, MEMTRACK_REDZONE);
+    memset(ptr + size, MEMTRACK_REDZONE_BYTE, MEMTRACK_REDZONE);
+
+    entry->ptr = ptr;
+    entry->caller = caller;
+    entry->size = size;
+    entry->seq = next_seq++;
+
+    unsigned int b = bucket_of(ptr);
+    entry->next = buckets[b];
+    buckets[b] = entry;
+    memtrack_live++;
+    spin_unlock_irqrestore(&memtrack_lock, flags);
+
+    return ptr;
+}
+
+/* Entry for a tracked address, or 0 */
+static memtrack_entry_t* memtrack_find(void* ptr) {
+    for (memtrack_entry_t* entry = buckets[bucket_of(ptr)]; entry; entry = entry->next) {
+        if (entry->ptr == ptr) {
+            return entry;
+        }
+    }
+    return 0;
+}
+
+/* Report a damaged red zone */
+static void report_redzone(memtrack_entry_t* entry, const char* where) {
+    redzone_errors++;
+    kprintf("ERROR: Red zone %s block %p (%u bytes, allocated by %p, #%u) was overwritten\n",
+            where, entry->ptr, entry->size, entry->caller, entry->seq);
+}
+
+/* Whether every byte of a red zone still holds the fill pattern */
+static int redzone_intact(unsigned char* zone) {
+    for (int i = 0; i < MEMTRACK_REDZONE; i++) {
+        if (zone[i] != MEMTRACK_REDZONE_BYTE) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Drop the record for ptr after checking its red zones. Returns the
+   start of the underlying block, or 0 if ptr is not tracked. */
+void* memtrack_remove(void* ptr) {
+    unsigned int flags = spin_lock_irqsave(&memtrack_lock);
+    memtrack_entry_t** link = &buckets[bucket_of(ptr)];
+    while (*link && (*link)->ptr != ptr) {
+        link = &(*link)->next;
+    }
+    memtrack_entry_t* entry = *link;
+    if (entry == 0) {
+        spin_unlock_irqrestore(&memtrack_lock, flags);
+        return 0;
+    }
+
+    unsigned char* block = (unsigned char*)ptr - MEMTRACK_REDZONE;
+    if (!redzone_intact(block)) {
+        report_redzone(entry, "before");
+    }
+    if (!redzone_intact((unsigned char*)ptr + entry->size)) {
+        report_redzone(entry, "after");
+    }
+
+    *link = entry->next;
+    entry->next = free_entries;
+    free_entries = entry;
+    memtrack_live--;
+    spin_unlock_irqrestore(&memtrack_lock, flags);
+
+    return block;
+}
+
+/* Requested size of a tracked block, 0 if ptr is not tracked */
+size_t memtrack_size(void* ptr) {
+    unsigned int flags = spin_lock_irqsave(&memtrack_lock);
+    memtrack_entry_t* entry = memtrack_find(ptr);
+    size_t size = entry ? entry->size : 0;
+    spin_unlock_irqrestore(&memtrack_lock, flags);
+    return size;
+}
+
+/* List live tracked blocks grouped by the call site that allocated them,
+   largest total first */
+void print_memory_leaks() {
+    memtrack_site_t sites[MEMTRACK_MAX_SITES];
+    int num_sites = 0;
+    int other_blocks = 0;
+    size_t total = 0;
+
+    kprintf("\nAllocation tracking: %s, %d live blocks, %u tracked so far\n",
+            memtrack_enabled ? "on" : "off", memtrack_live, next_seq);
+    if (dropped || redzone_errors) {
+        kprintf("  %u blocks untracked (table full), %u red zone errors\n", dropped, redzone_errors);
+    }
+    if (memtrack_live == 0) {
+        return;
+    }
+
+    unsigned int flags = spin_lock_irqsave(&memtrack_lock);
+    for (int b = 0; b < MEMTRACK_BUCKETS; b++) {
+        for (memtrack_entry_t* entry = buckets[b]; entry; entry = entry->next) {
+            total += entry->size;
+
+            int s = 0;
+            while (s < num_sites && sites[s].caller != entry->caller) {
+                s++;
+            }
+            if (s == num_sites) {
+                if (num_sites == MEMTRACK_MAX_SITES) {
+                    other_blocks++;
+                    continue;
+                }
+                sites[s].caller = entry->caller;
+                sites[s].blocks = 0;
+                sites[s].bytes = 0;
+                sites[s].oldest = entry->seq;
+                num_sites++;
+            }
+
+            sites[s].blocks++;
+            sites[s].bytes += entry->size;
+            if (entry->seq < sites[s].oldest) {
+                sites[s].oldest = entry->seq;
+            }
+        }
+    }
+    spin_unlock_irqrestore(&memtrack_lock, flags);
+
+    // Largest first
+    for (int i = 1; i < num_sites; i++) {
+        memtrack_site_t site = sites[i];
+        int j = i - 1;
+        while (j >= 0 && sites[j].bytes < site.bytes) {
+            sites[j + 1] = sites[j];
+            j--;
+        }
+        sites[j + 1] = site;
+    }
+
+    kprintf("Live blocks by call site (%u bytes):\n", total);
+    for (int i = 0; i < num_sites; i++) {
+        kprintf("  %p: %d %s, %u bytes (oldest #%u)\n", sites[i].caller, sites[i].blocks,
+                sites[i].blocks == 1 ? "block" : "blocks", sites[i].bytes, sites[i].oldest);
+    }
+    if (other_blocks) {
+        kprintf("  ... %d blocks from other call sites\n", other_blocks);
+    }
+}
@@ -0,0 +1,29 @@
+#ifndef MEMTRACK_H
+#define MEMTRACK_H
+
+#include "memory.h"
+
+/* Red zones on both sides of a tracked block, checked when it is freed */
+#define MEMTRACK_REDZONE      16
+#define MEMTRACK_REDZONE_BYTE 0xFD
+
+/* Hash table size - allocated the first time tracking is switched on */
+#define MEMTRACK_BUCKETS      4096
+#define MEMTRACK_MAX_ENTRIES  8192
+
+/* Call sites listed by print_memory_leaks() */
+#define MEMTRACK_MAX_SITES    32
+
+/* Checked by kmalloc()/kfree() - with tracking off and nothing tracked
+   still live, the allocation path does no tracking work */
+extern int memtrack_enabled;        /* New kmalloc() blocks are tracked */
+extern int memtrack_live;           /* Tracked blocks not yet freed */
+
+/* Function prototypes */
+int memtrack_enable(int on);        /* Returns 0 if the table can't be allocated */
+void* memtrack_add(void* block, size_t size, void* caller);
+void* memtrack_remove(void* ptr);
+size_t memtrack_size(void* ptr);
+void print_memory_leaks();
+
+#endif /* MEMTRACK_H */
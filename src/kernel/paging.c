@@ -0,0 +1,360 @@
+/* paging.c - Identity-mapped page tables and hardware memory protection */
+#include "paging.h"
+#include "idt.h"
+#include "cpu.h"
+#include "console.h"
+#include "serial.h"
+#include "kprintf.h"
+#include "spinlock.h"
+
+/* Forward declaration of print function */
+void print(const char *str);
+
+/* Entries per table: 1024 x 32-bit, or 512 x 64-bit with PAE */
+#define ENTRIES_32   1024
+#define ENTRIES_PAE  512
+
+static int use_pae = 0;             // 64-bit entries, needed for NX
+static int use_nx = 0;              // EFER.NXE set
+static int enabled = 0;
+static int mapped_pages = 0;        // Pages identity mapped from address 0
+static int table_pages = 0;         // Pages used by the paging structures
+
+static unsigned int* page_directory;            // 32-bit paging
+static unsigned long long* pae_pdpt;            // PAE: 4 directory pointers
+static unsigned long long* pae_directories;     // PAE: 4 contiguous directories
+static spinlock_t table_lock = SPINLOCK_INIT;   // Guards adding page tables
+
+/* Resume address of a running probe (paging_probe.asm) */
+extern unsigned int probe_fixup;
+
+/* Last fault caught by a probe */
+static unsigned int last_fault_addr = 0;
+static unsigned int last_fault_error = 0;
+static unsigned int faults_caught = 0;
+
+/* Entry flags for a MEM_PERM_* combination. x86 cannot map a page
+   write-only, so any access permission makes the page present. */
+static unsigned long long perm_to_flags(unsigned char perm) {
+    unsigned long long flags = 0;
+
+    if (perm & MEM_PERM_RWX) {
+        flags |= PTE_PRESENT;
+    }
+    if (perm & MEM_PERM_WRITE) {
+        flags |= PTE_WRITE;
+    }
+    if (use_nx && !(perm & MEM_PERM_EXEC)) {
+        flags |= PTE_NX;
+    }
+    return flags;
+}
+
+/* Point the entry for a page at a physical address. Its table must exist. */
+static void set_entry_addr(int page, unsigned long long addr, unsigned long long flags) {
+    if (use_pae) {
+        unsigned long long* table = (unsigned long long*)(unsigned int)
+            (pae_directories[page / ENTRIES_PAE] & ~0xFFFULL);
+        table[page % ENTRIES_PAE] = addr | flags;
+    } else {
+        unsigned int* table = (unsigned int*)(page_directory[page / ENTRIES_32] & ~0xFFF);
+        table[page % ENTRIES_32] = (unsigned int)addr | (unsigned int)flags;
+    }
+}
+
+/* Set the entry for a page of the identity map */
+static void set_entry(int page, unsigned long long flags) {
+    set_entry_addr(page, (unsigned long long)page * PAGE_SIZE, flags);
+}
+
+/* Entry for any page of the 4 GB address space, 0 if its table is missing */
+static unsigned long long get_entry(int page) {
+    if (use_pae) {
+        unsigned long long dir = pae_directories[page / ENTRIES_PAE];
+        if (!(dir & PTE_PRESENT)) {
+            return 0;
+        }
+        return ((unsigned long long*)(unsigned int)(dir & ~0xFFFULL))[page % ENTRIES_PAE];
+    }
+
+    unsigned int dir = page_directory[page / ENTRIES_32];
+    if (!(dir & PTE_PRESENT)) {
+        return 0;
+    }
+    return ((unsigned int*)(dir & ~0xFFF))[page % ENTRIES_32];
+}
+
+/* Whether the page table covering a page exists */
+static inline int has_table(int page) {
+    return use_pae ? (pae_directories[page / ENTRIES_PAE] & PTE_PRESENT) != 0
+                   : (page_directory[page / ENTRIES_32] & PTE_PRESENT) != 0;
+}
+
+/* Make sure the page table covering a page exists. Tables outside the
+   identity map are allocated on first use and kept. The table is
+   allocated before table_lock is taken; a CPU that loses the race to
+   install it gives its copy back. */
+static int ensure_table(int page) {
+    if (has_table(page)) {
+        return 1;
+    }
+
+    void* table = page_alloc();
+    if (table == 0) {
+        return 0;
+    }
+    unsigned int flags = spin_lock_irqsave(&table_lock);
+    if (!has_table(page)) {
+        if (use_pae) {
+            pae_directories[page / ENTRIES_PAE] = (unsigned int)table | PTE_PRESENT | PTE_WRITE;
+        } else {
+            page_directory[page / ENTRIES_32] = (unsigned int)table | PTE_PRESENT | PTE_WRITE;
+        }
+        table_pages++;
+        table = 0;
+    }
+    spin_unlock_irqrestore(&table_lock, flags);
+
+    if (table) {
+        page_free(table);
+    }
+    return 1;
+}
+
+/* Load the tables into this CPU and turn paging on */
+static void enable_paging() {
+    if (use_pae) {
+        write_cr4(read_cr4() | CR4_PAE);
+        if (use_nx) {
+            wrmsr(MSR_EFER, rdmsr(MSR_EFER) | EFER_NXE);
+        }
+        write_cr3((unsigned int)pae_pdpt);
+    } else {
+        write_cr3((unsigned int)page_directory);
+    }
+    // WP makes read-only pages apply to the kernel as well
+    write_cr0(read_cr0() | CR0_PG | CR0_WP);
+}
+
+/* Report a page fault. Faults raised by a probe resume at its fixup
+   address; any other fault is a kernel bug and halts. */
+static void page_fault_handler(interrupt_frame_t* frame) {
+    unsigned int addr = read_cr2();
+
+    if (probe_fixup) {
+        last_fault_addr = addr;
+        last_fault_error = frame->error_code;
+        faults_caught++;
+        frame->eip = probe_fixup;
+        return;
+    }
+
+    last_fault_addr = addr;
+    last_fault_error = frame->error_code;
+    print("\nPAGE FAULT: ");
+    print_last_page_fault();
+    kprintf(" (eip %p)\nSystem halted.\n", (void*)frame->eip);
+    console_flush();
+    serial_flush();
+
+    while (1) {
+        __asm__ volatile("cli; hlt");
+    }
+}
+
+/* Build the identity map for all tracked RAM and turn paging on.
+   Uses PAE when the CPU has NX so non-executable pages are enforced. */
+void init_paging() {
+    unsigned int eax, ebx, ecx, edx;
+
+    if (cpuid_supported()) {
+        cpuid(1, &eax, &ebx, &ecx, &edx);
+        int has_pae = (edx & CPUID_FEAT_EDX_PAE) != 0;
+
+        cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+        if (has_pae && eax >= 0x80000001) {
+            cpuid(0x80000001, &eax, &ebx, &ecx, &edx);
+            use_pae = (edx & CPUID_EXT_FEAT_EDX_NX) != 0;
+            use_nx = use_pae;
+        }
+    }
+
+    // Whole tables, so the last one maps past the end of RAM
+    int entries = use_pae ? ENTRIES_PAE : ENTRIES_32;
+    int tables = (get_total_pages() + entries - 1) / entries;
+    mapped_pages = tables * entries;
+
+    // Zeroed allocations - unused directory entries are not present
+    if (use_pae) {
+        pae_pdpt = (unsigned long long*)page_alloc();
+        pae_directories = (unsigned long long*)page_alloc_multiple(4);
+        if (pae_pdpt == 0 || pae_directories == 0) {
+            print("ERROR: Not enough memory for page tables\n");
+            return;
+        }
+        for (int i = 0; i < 4; i++) {
+            // Directory pointers only take the present bit
+            pae_pdpt[i] = (unsigned int)(pae_directories + i * ENTRIES_PAE) | PTE_PRESENT;
+        }
+        table_pages = 5;
+    } else {
+        page_directory = (unsigned int*)page_alloc();
+        if (page_directory == 0) {
+            print("ERROR: Not enough memory for page tables\n");
+            return;
+        }
+        table_pages = 1;
+    }
+
+    for (int i = 0; i < tables; i++) {
+        void* table = page_alloc();
+        if (table == 0) {
+            print("ERROR: Not enough memory for page tables\n");
+            return;
+        }
+        if (use_pae) {
+            pae_directories[i] = (unsigned int)table | PTE_PRESENT | PTE_WRITE;
+        } else {
+            page_directory[i] = (unsigned int)table | PTE_PRESENT | PTE_WRITE;
+        }
+        table_pages++;
+    }
+
+    // Everything read/write/execute except page 0, so NULL dereferences fault
+    unsigned long long rwx = perm_to_flags(MEM_PERM_RWX);
+    for (int page = 1; page < mapped_pages; page++) {
+        set_entry(page, rwx);
+    }
+
+    register_interrupt_handler(EXC_PAGE_FAULT, page_fault_handler);
+
+    enable_paging();
+    enabled = 1;
+
+    kprintf("Paging enabled: %d MB identity mapped, %s %s NX\n", mapped_pages / 256,
+            use_pae ? "PAE" : "32-bit", use_nx ? "with" : "without");
+}
+
+/* Turn paging on for an application processor, sharing the boot CPU's
+   tables. Changes made later are not flushed from its TLB, so APs only
+   run code that does not depend on mappings changing under it. */
+void paging_init_ap() {
+    if (enabled) {
+        enable_paging();
+    }
+}
+
+/* Whether paging is on */
+int paging_enabled() {
+    return enabled;
+}
+
+/* Whether non-executable pages are enforced */
+int paging_has_nx() {
+    return use_nx;
+}
+
+/* Apply MEM_PERM_* to every page touched by [addr, addr + size) */
+void paging_set_permissions(void* addr, size_t size, unsigned char perm) {
+    if (!enabled || size == 0) {
+        return;
+    }
+
+    int first = (unsigned int)addr / PAGE_SIZE;
+    int last = ((unsigned int)addr + size - 1) / PAGE_SIZE;
+    unsigned long long flags = perm_to_flags(perm);
+
+    for (int page = first; page <= last && page < mapped_pages; page++) {
+        // Page 0 stays unmapped
+        if (page == 0) {
+            continue;
+        }
+        set_entry(page, flags);
+        invlpg((void*)(page * PAGE_SIZE));
+    }
+}
+
+/* Map one page outside the identity map, e.g. in the vmalloc area.
+   Returns 0 if its page table cannot be allocated. */
+int paging_map_page(void* virt, unsigned int phys, unsigned char perm) {
+    int page = (unsigned int)virt / PAGE_SIZE;
+
+    if (!enabled || page < mapped_pages || !ensure_table(page)) {
+        return 0;
+    }
+    set_entry_addr(page, phys, perm_to_flags(perm));
+    invlpg(virt);
+    return 1;
+}
+
+/* Remove a mapping made by paging_map_page() */
+void paging_unmap_page(void* virt) {
+    int page = (unsigned int)virt / PAGE_SIZE;
+
+    if (!enabled || page < mapped_pages || !(get_entry(page) & PTE_PRESENT)) {
+        return;
+    }
+    set_entry_addr(page, 0, 0);
+    invlpg(virt);
+}
+
+/* Identity map device registers at [phys, phys + size) with caching
+   off, e.g. the local APIC. Returns 0 if a page table can't be allocated. */
+int paging_map_mmio(unsigned int phys, size_t size) {
+    if (!enabled || size == 0) {
+        return 1;
+    }
+
+    int first = phys / PAGE_SIZE;
+    int last = (phys + size - 1) / PAGE_SIZE;
+    unsigned long long flags = perm_to_flags(MEM_PERM_RW) | PTE_PCD | PTE_PWT;
+
+    for (int page = first; page <= last; page++) {
+        if (!ensure_table(page)) {
+            return 0;
+        }
+        set_entry(page, flags);
+        invlpg((void*)((unsigned int)page * PAGE_SIZE));
+    }
+    return 1;
+}
+
+/* Physical address a virtual address maps to, 0 if it is not mapped */
+unsigned int paging_get_phys(void* virt) {
+    if (!enabled) {
+        return (unsigned int)virt;
+    }
+
+    unsigned long long entry = get_entry((unsigned int)virt / PAGE_SIZE);
+    if (!(entry & PTE_PRESENT)) {
+        return 0;
+    }
+    return (unsigned int)(entry & 0xFFFFF000ULL) | ((unsigned int)virt & (PAGE_SIZE - 1));
+}
+
+/* Print the paging mode and table usage */
+void print_paging_info() {
+    print("\nPaging:\n");
+    if (!enabled) {
+        print("  Disabled\n");
+        return;
+    }
+    print("  Mode: ");
+    print(use_pae ? "PAE" : "32-bit");
+    print(use_nx ? ", NX enforced\n" : ", no NX (execute permission not enforced)\n");
+    kprintf("  Identity mapped: %d MB in %d pages of tables\n", mapped_pages / 256, table_pages);
+    kprintf("  Faults caught by probes: %u\n", faults_caught);
+}
+
+/* Describe the last fault: access type, cause and address */
+void print_last_page_fault() {
+    if (last_fault_error & PF_FETCH) {
+        print("execute");
+    } else if (last_fault_error & PF_WRITE) {
+        print("write");
+    } else {
+        print("read");
+    }
+    print((last_fault_error & PF_PROTECTION) ? " violates page protection" : " of a page that is not present");
+    kprintf(" at address %p", (void*)last_fault_addr);
+}
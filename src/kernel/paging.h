@@ -0,0 +1,39 @@
+#ifndef PAGING_H
+#define PAGING_H
+
+#include "memory.h"
+
+/* Page table entry bits (the same in 32-bit and PAE entries) */
+#define PTE_PRESENT  0x001
+#define PTE_WRITE    0x002
+#define PTE_USER     0x004
+#define PTE_PWT      0x008          /* Write-through */
+#define PTE_PCD      0x010          /* Cache disabled - device memory */
+#define PTE_NX       (1ULL << 63)   /* PAE only, needs EFER.NXE */
+
+/* Page fault error code bits */
+#define PF_PROTECTION 0x01  /* 0 = page not present, 1 = protection violation */
+#define PF_WRITE      0x02  /* Fault on a write */
+#define PF_USER       0x04  /* Fault in ring 3 */
+#define PF_RESERVED   0x08  /* Reserved bit set in an entry */
+#define PF_FETCH      0x10  /* Instruction fetch (NX) */
+
+/* Function prototypes */
+void init_paging();                 /* Identity map RAM and enable paging */
+void paging_init_ap();              /* Same tables on an application processor */
+int paging_enabled();
+int paging_has_nx();
+void paging_set_permissions(void* addr, size_t size, unsigned char perm);
+int paging_map_page(void* virt, unsigned int phys, unsigned char perm); /* Outside the identity map only */
+void paging_unmap_page(void* virt);
+unsigned int paging_get_phys(void* virt);   /* 0 if not mapped */
+int paging_map_mmio(unsigned int phys, size_t size);    /* Uncached identity map */
+void print_paging_info();
+void print_last_page_fault();       /* Describe the fault a probe caught */
+
+/* Probes (paging_probe.asm) - 0 = allowed, 1 = page fault caught */
+int probe_read(const void* addr);
+int probe_write(void* addr);
+int probe_exec(void* addr);         /* addr must hold a ret instruction */
+
+#endif /* PAGING_H */
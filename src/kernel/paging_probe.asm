@@ -0,0 +1,49 @@
+; paging_probe.asm - Touch an address and report whether it page faulted
+; Each probe stores a resume address in probe_fixup before the access.
+; The page fault handler in paging.c jumps there instead of halting.
+[bits 32]
+[global probe_read]
+[global probe_write]
+[global probe_exec]
+[global probe_fixup]
+
+section .text
+
+; int probe_read(const void* addr) - 0 = allowed, 1 = faulted
+probe_read:
+    mov edx, [esp + 4]
+    mov dword [probe_fixup], probe_failed
+    mov al, [edx]
+    jmp probe_ok
+
+; int probe_write(void* addr) - rewrites the byte already there
+probe_write:
+    mov edx, [esp + 4]
+    mov dword [probe_fixup], probe_failed
+    mov al, [edx]
+    mov [edx], al
+    jmp probe_ok
+
+; int probe_exec(void* addr) - addr must hold a ret instruction (0xC3)
+probe_exec:
+    mov edx, [esp + 4]
+    mov dword [probe_fixup], probe_exec_failed
+    call edx
+    jmp probe_ok
+
+probe_exec_failed:
+    add esp, 4                  ; Return address pushed by the faulting call
+probe_failed:
+    mov dword [probe_fixup], 0
+    mov eax, 1
+    ret
+
+probe_ok:
+    mov dword [probe_fixup], 0
+    xor eax, eax
+    ret
+
+section .data
+
+probe_fixup:
+    dd 0                        ; Resume address while a probe runs, else 0
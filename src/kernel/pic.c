@@ -0,0 +1,84 @@
+/* pic.c - 8259 interrupt controller setup */
+#include "pic.h"
+
+/* Port I/O (kernel.c, keyboard.c) */
+void outb(unsigned short port, unsigned char value);
+unsigned char inb(unsigned short port);
+
+/* Give the PIC time to settle between initialization words */
+static inline void io_wait() {
+    outb(0x80, 0);
+}
+
+/* Move IRQ 0-15 to vectors IRQ_BASE..IRQ_BASE + 15 - the BIOS leaves
+   them on top of the CPU exceptions - and mask every line. Drivers
+   unmask the lines they handle. */
+void init_pic() {
+    // ICW1: start initialization, ICW4 follows
+    outb(PIC1_COMMAND, 0x11);
+    io_wait();
+    outb(PIC2_COMMAND, 0x11);
+    io_wait();
+
+    // ICW2: vector offsets
+    outb(PIC1_DATA, IRQ_BASE);
+    io_wait();
+    outb(PIC2_DATA, IRQ_BASE + 8);
+    io_wait();
+
+    // ICW3: slave on IRQ 2
+    outb(PIC1_DATA, 1 << IRQ_CASCADE);
+    io_wait();
+    outb(PIC2_DATA, IRQ_CASCADE);
+    io_wait();
+
+    // ICW4: 8086 mode
+    outb(PIC1_DATA, 0x01);
+    io_wait();
+    outb(PIC2_DATA, 0x01);
+    io_wait();
+
+    // Everything masked except the cascade line
+    outb(PIC1_DATA, (unsigned char)~(1 << IRQ_CASCADE));
+    outb(PIC2_DATA, 0xFF);
+}
+
+/* Let an IRQ line through */
+void pic_unmask(int irq) {
+    unsigned short port = irq < 8 ? PIC1_DATA : PIC2_DATA;
+    outb(port, inb(port) & ~(1 << (irq % 8)));
+}
+
+/* Block an IRQ line */
+void pic_mask(int irq) {
+    unsigned short port = irq < 8 ? PIC1_DATA : PIC2_DATA;
+    outb(port, inb(port) | (1 << (irq % 8)));
+}
+
+/* Acknowledge an IRQ - the slave's lines need both PICs told */
+void pic_send_eoi(int irq) {
+    if (irq >= 8) {
+        outb(PIC2_COMMAND, PIC_EOI);
+    }
+    outb(PIC1_COMMAND, PIC_EOI);
+}
+
+/* A PIC reports IRQ 7 (or 15) when a request went away before it was
+   acknowledged. Those must not get an EOI from the PIC that raised them. */
+int pic_is_spurious(int irq) {
+    if (irq != 7 && irq != 15) {
+        return 0;
+    }
+
+    unsigned short port = irq == 7 ? PIC1_COMMAND : PIC2_COMMAND;
+    outb(port, PIC_READ_ISR);
+    if (inb(port) & 0x80) {
+        return 0;
+    }
+
+    // The master still saw a real request on the cascade line
+    if (irq == 15) {
+        outb(PIC1_COMMAND, PIC_EOI);
+    }
+    return 1;
+}
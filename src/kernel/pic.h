@@ -0,0 +1,30 @@
+#ifndef PIC_H
+#define PIC_H
+
+/* 8259 programmable interrupt controllers */
+#define PIC1_COMMAND  0x20
+#define PIC1_DATA     0x21
+#define PIC2_COMMAND  0xA0
+#define PIC2_DATA     0xA1
+
+#define PIC_EOI       0x20          /* End of interrupt */
+#define PIC_READ_ISR  0x0B          /* OCW3: next command port read returns the ISR */
+
+/* IRQs are moved past the CPU exceptions: IRQ n arrives on vector IRQ_BASE + n */
+#define IRQ_BASE      32
+#define IRQ_COUNT     16
+
+/* IRQ lines */
+#define IRQ_TIMER     0
+#define IRQ_KEYBOARD  1
+#define IRQ_CASCADE   2             /* Slave PIC */
+#define IRQ_COM1      4
+
+/* Function prototypes */
+void init_pic();                    /* Remap both PICs, every line masked */
+void pic_unmask(int irq);
+void pic_mask(int irq);
+void pic_send_eoi(int irq);
+int pic_is_spurious(int irq);       /* IRQ 7/15 raised without a real request */
+
+#endif /* PIC_H */
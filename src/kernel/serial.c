@@ -0,0 +1,301 @@
+/* serial.c - Interrupt-driven console on COM1: a copy of the screen
+   output for headless runs, and keys for the shell */
+#include "serial.h"
+#include "idt.h"
+#include "pic.h"
+#include "keyboard.h"
+#include "spinlock.h"
+#include "kprintf.h"
+#include "console.h"
+
+/* Port I/O from kernel.c */
+void outb(unsigned short port, unsigned char value);
+unsigned char inb(unsigned short port);
+
+static int present = 0;
+
+/* Bytes waiting to go out. The UART takes a FIFO load at a time, from
+   the THRE interrupt once it has sent the previous one. tx_active is set
+   while that interrupt is enabled. */
+static unsigned char tx_ring[SERIAL_TX_RING];
+static unsigned int tx_head = 0;            // Next slot to fill
+static unsigned int tx_tail = 0;            // Next byte to send
+static int tx_active = 0;
+static spinlock_t serial_lock = SPINLOCK_INIT;  // Guards the transmit side
+
+/* Bytes received. The IRQ 4 handler is the only writer of rx_head and
+   serial_get_key() the only writer of rx_tail, as for the keyboard. */
+static volatile unsigned char rx_ring[SERIAL_RX_RING];
+static volatile unsigned int rx_head = 0;
+static volatile unsigned int rx_tail = 0;
+static int escape_state = 0;                // Progress through an ESC [ sequence
+static int after_cr = 0;                    // Swallow the \n of a \r\n
+
+/* Counters for the serial command */
+static unsigned int tx_bytes = 0;
+static unsigned int tx_loads = 0;           // FIFO loads written
+static unsigned int tx_interrupts = 0;
+static unsigned int tx_polled = 0;          // Loads written by polling on a full ring
+static unsigned int rx_bytes = 0;
+static unsigned int rx_dropped = 0;
+
+static inline unsigned char reg_read(int reg) {
+    return inb(SERIAL_COM1 + reg);
+}
+
+static inline void reg_write(int reg, unsigned char value) {
+    outb(SERIAL_COM1 + reg, value);
+}
+
+/* Write up to a FIFO's worth from the ring - the FIFO must be empty */
+static void tx_fill() {
+    int count = 0;
+    while (count < SERIAL_FIFO_SIZE && tx_tail != tx_head) {
+        reg_write(SERIAL_DATA, tx_ring[tx_tail]);
+        tx_tail = (tx_tail + 1) % SERIAL_TX_RING;
+        count++;
+    }
+    if (count) {
+        tx_bytes += count;
+        tx_loads++;
+    }
+}
+
+/* Queue a byte. A full ring is emptied a FIFO load at a time, waiting
+   on the line status once per load rather than once per byte. */
+static void tx_put(unsigned char c) {
+    unsigned int next = (tx_head + 1) % SERIAL_TX_RING;
+    if (next == tx_tail) {
+        while (!(reg_read(SERIAL_LSR) & SERIAL_LSR_THRE)) {
+            __asm__ volatile("pause");
+        }
+        tx_fill();
+        tx_polled++;
+    }
+    tx_ring[tx_head] = c;
+    tx_head = next;
+}
+
+/* Get an idle transmitter going: fill the FIFO now if it is empty, and
+   have the UART interrupt for the rest */
+static void tx_start() {
+    if (tx_active) {
+        return;
+    }
+    if (reg_read(SERIAL_LSR) & SERIAL_LSR_THRE) {
+        tx_fill();
+    }
+    if (tx_tail != tx_head) {
+        tx_active = 1;
+        reg_write(SERIAL_IER, SERIAL_IER_RX | SERIAL_IER_THRE);
+    }
+}
+
+/* IRQ 4 - refill the transmit FIFO, queue received bytes */
+static void serial_irq(interrupt_frame_t* frame) {
+    (void)frame;
+    int received = 0;
+
+    spin_lock(&serial_lock);
+    while (1) {
+        unsigned char iir = reg_read(SERIAL_IIR);
+        if (iir & SERIAL_IIR_NONE) {
+            break;
+        }
+
+        switch (iir & SERIAL_IIR_ID) {
+            case SERIAL_IIR_THRE:
+                tx_interrupts++;
+                tx_fill();
+                if (tx_tail == tx_head) {
+                    tx_active = 0;
+                    reg_write(SERIAL_IER, SERIAL_IER_RX);
+                }
+                break;
+            case SERIAL_IIR_RX:
+            case SERIAL_IIR_TIMEOUT:
+                while (reg_read(SERIAL_LSR) & SERIAL_LSR_DR) {
+                    unsigned char c = reg_read(SERIAL_DATA);
+                    unsigned int next = (rx_head + 1) % SERIAL_RX_RING;
+                    if (next == rx_tail) {
+                        rx_dropped++;
+                        continue;
+                    }
+                    rx_ring[rx_head] = c;
+                    // The byte must be stored before the consumer can see the new head
+                    __asm__ volatile("" : : : "memory");
+                    rx_head = next;
+                    rx_bytes++;
+                    received = 1;
+                }
+                break;
+            case SERIAL_IIR_LSR:
+                reg_read(SERIAL_LSR);
+                break;
+            default:
+                reg_read(SERIAL_MSR);
+                break;
+        }
+    }
+    spin_unlock(&serial_lock);
+
+    if (received) {
+        keyboard_notify();
+    }
+}
+
+/* Check for a UART, set 115200 8N1 with the FIFOs on and take over
+   IRQ 4 */
+void init_serial() {
+    // Nothing answers at the port if there is no COM1
+    reg_write(SERIAL_SCRATCH, 0x5A);
+    if (reg_read(SERIAL_SCRATCH) != 0x5A) {
+        return;
+    }
+
+    reg_write(SERIAL_IER, 0);
+    reg_write(SERIAL_LCR, SERIAL_LCR_DLAB);
+    reg_write(SERIAL_DATA, SERIAL_BAUD_DIVISOR & 0xFF);
+    reg_write(SERIAL_IER, (SERIAL_BAUD_DIVISOR >> 8) & 0xFF);
+    reg_write(SERIAL_LCR, SERIAL_LCR_8N1);
+    reg_write(SERIAL_FCR, SERIAL_FCR_ENABLE);
+    reg_write(SERIAL_MCR, SERIAL_MCR_OUT2);
+
+    // Drop whatever arrived before now and clear pending causes
+    while (reg_read(SERIAL_LSR) & SERIAL_LSR_DR) {
+        reg_read(SERIAL_DATA);
+    }
+    reg_read(SERIAL_IIR);
+    reg_read(SERIAL_MSR);
+
+    register_interrupt_handler(IRQ_BASE + IRQ_COM1, serial_irq);
+    reg_write(SERIAL_IER, SERIAL_IER_RX);
+    pic_unmask(IRQ_COM1);
+    present = 1;
+}
+
+int serial_present() {
+    return present;
+}
+
+/* Queue console output. Line ends become \r\n, and a backspace also
+   erases, as it does on the screen. */
+void serial_write(const char* str, size_t len) {
+    if (!present) {
+        return;
+    }
+
+    unsigned int flags = spin_lock_irqsave(&serial_lock);
+    for (size_t i = 0; i < len; i++) {
+        if (str[i] == '\n') {
+            tx_put('\r');
+        } else if (str[i] == '\b') {
+            tx_put('\b');
+            tx_put(' ');
+        }
+        tx_put(str[i]);
+    }
+    tx_start();
+    spin_unlock_irqrestore(&serial_lock, flags);
+}
+
+/* Send everything queued without interrupts. Only for halting - the
+   lock is not taken, the code that faulted may hold it. */
+void serial_flush() {
+    if (!present) {
+        return;
+    }
+
+    unsigned int flags = irq_save();
+    while (tx_tail != tx_head) {
+        while (!(reg_read(SERIAL_LSR) & SERIAL_LSR_THRE)) {
+            __asm__ volatile("pause");
+        }
+        tx_fill();
+    }
+    irq_restore(flags);
+}
+
+/* Whether received bytes are waiting */
+int serial_has_input() {
+    return rx_head != rx_tail;
+}
+
+static int rx_pop() {
+    if (rx_tail == rx_head) {
+        return -1;
+    }
+    unsigned char c = rx_ring[rx_tail];
+    // Read the slot before handing it back to the handler
+    __asm__ volatile("" : : : "memory");
+    rx_tail = (rx_tail + 1) % SERIAL_RX_RING;
+    return c;
+}
+
+/* Translate what a terminal sends into get_key() values: Enter is \r,
+   Backspace is DEL, and the cursor keys are ESC [ sequences */
+unsigned char serial_get_key() {
+    int c;
+
+    while ((c = rx_pop()) != -1) {
+        if (escape_state == 1) {
+            escape_state = (c == '[') ? 2 : 0;
+            continue;
+        }
+        if (escape_state == 2) {
+            escape_state = 0;
+            switch (c) {
+                case 'A': return KEY_UP;
+                case 'B': return KEY_DOWN;
+                case 'C': return KEY_RIGHT;
+                case 'D': return KEY_LEFT;
+                case 'H': return KEY_HOME;
+                case 'F': return KEY_END;
+                case '3': escape_state = 3; continue;    // ESC [ 3 ~ is Delete
+                default: continue;
+            }
+        }
+        if (escape_state == 3) {
+            escape_state = 0;
+            if (c == '~') {
+                return KEY_DELETE;
+            }
+            continue;
+        }
+
+        int was_cr = after_cr;
+        after_cr = (c == '\r');
+        if (c == 0x1B) {
+            escape_state = 1;
+        } else if (c == '\r') {
+            return '\n';
+        } else if (c == '\n') {
+            if (!was_cr) {
+                return '\n';
+            }
+        } else if (c == 0x7F || c == '\b') {
+            return '\b';
+        } else if (c >= 32 && c <= 126) {
+            return (unsigned char)c;
+        }
+    }
+    return 0;
+}
+
+/* Print the serial console counters */
+void print_serial_info() {
+    if (!present) {
+        print("\nSerial console: no UART at COM1\n");
+        return;
+    }
+
+    unsigned int flags = spin_lock_irqsave(&serial_lock);
+    unsigned int queued = (tx_head - tx_tail + SERIAL_TX_RING) % SERIAL_TX_RING;
+    spin_unlock_irqrestore(&serial_lock, flags);
+
+    kprintf("\nSerial console: COM1 at %d baud, %d byte FIFO\n", 115200 / SERIAL_BAUD_DIVISOR, SERIAL_FIFO_SIZE);
+    kprintf("  Sent: %u bytes in %u FIFO loads, %u transmit interrupts\n", tx_bytes, tx_loads, tx_interrupts);
+    kprintf("  %u loads written by polling with the %d byte ring full, %u bytes queued\n",
+            tx_polled, SERIAL_TX_RING, queued);
+    kprintf("  Received: %u bytes, %u dropped\n", rx_bytes, rx_dropped);
+}
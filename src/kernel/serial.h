@@ -0,0 +1,51 @@
+#ifndef SERIAL_H
+#define SERIAL_H
+
+#include "memory.h"
+
+/* 16550 UART on COM1, set up by the boot sector with its FIFO enabled */
+#define SERIAL_COM1         0x3F8
+#define SERIAL_DATA         0       /* Register offsets from the base port */
+#define SERIAL_IER          1       /* Interrupt enable */
+#define SERIAL_IIR          2       /* Interrupt identification (read) */
+#define SERIAL_FCR          2       /* FIFO control (write) */
+#define SERIAL_LCR          3       /* Line control */
+#define SERIAL_MCR          4       /* Modem control */
+#define SERIAL_LSR          5       /* Line status */
+#define SERIAL_MSR          6       /* Modem status */
+#define SERIAL_SCRATCH      7
+
+#define SERIAL_IER_RX       0x01    /* Received data available */
+#define SERIAL_IER_THRE     0x02    /* Transmit holding register empty */
+#define SERIAL_IIR_NONE     0x01    /* No interrupt pending */
+#define SERIAL_IIR_ID       0x0E    /* Cause of the interrupt: */
+#define SERIAL_IIR_MSR      0x00    /*   modem status changed */
+#define SERIAL_IIR_THRE     0x02    /*   transmit FIFO empty */
+#define SERIAL_IIR_RX       0x04    /*   receive FIFO reached its trigger level */
+#define SERIAL_IIR_LSR      0x06    /*   line error */
+#define SERIAL_IIR_TIMEOUT  0x0C    /*   bytes waiting in the receive FIFO */
+#define SERIAL_LSR_DR       0x01    /* Data ready */
+#define SERIAL_LSR_THRE     0x20    /* Transmit FIFO empty */
+#define SERIAL_LCR_DLAB     0x80    /* Divisor latch access */
+#define SERIAL_LCR_8N1      0x03
+#define SERIAL_FCR_ENABLE   0xC7    /* Enable and clear both FIFOs, receive trigger at 14 bytes */
+#define SERIAL_MCR_OUT2     0x0B    /* DTR, RTS and OUT2 - OUT2 gates the IRQ line */
+
+#define SERIAL_BAUD_DIVISOR 1       /* 115200 baud */
+#define SERIAL_FIFO_SIZE    16      /* Bytes written per transmit interrupt */
+
+/* Output waits in a ring until the UART asks for more - a full ring is
+   emptied by polling, one FIFO load at a time */
+#define SERIAL_TX_RING      4096
+#define SERIAL_RX_RING      256
+
+/* Function prototypes */
+void init_serial();                 /* Take over IRQ 4. Call with interrupts off, before sti. */
+int serial_present();
+void serial_write(const char* str, size_t len);     /* \n goes out as \r\n */
+void serial_flush();                /* Send everything queued by polling - for halting */
+int serial_has_input();
+unsigned char serial_get_key();     /* Keys as get_key() returns them, 0 if none */
+void print_serial_info();
+
+#endif /* SERIAL_H */
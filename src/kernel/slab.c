@@ -0,0 +1,329 @@
+/* slab.c - Size-class object allocator built on the page allocator */
+#include "slab.h"
+#include "spinlock.h"
+#include "kprintf.h"
+
+/* Forward declaration of print function */
+void print(const char *str);
+
+/* Objects start after the slab header, 8-byte aligned */
+#define SLAB_HEADER_SIZE ((sizeof(slab_t) + 7) & ~7)
+
+/* Cache of kmem_cache_t descriptors, used by kmem_cache_create() */
+static kmem_cache_t cache_cache;
+
+/* kmalloc() size classes */
+static kmem_cache_t size_caches[SLAB_NUM_CLASSES];
+static const char* size_cache_names[SLAB_NUM_CLASSES] = {
+    "kmalloc-8", "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+    "kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048"
+};
+
+/* All caches, for statistics */
+static kmem_cache_t* cache_chain = 0;
+
+/* Guards the slab lists of every cache and the cache chain */
+static spinlock_t slab_lock = SPINLOCK_INIT;
+
+/* kmalloc() efficiency counters (cumulative since boot) */
+static unsigned int kmalloc_requested = 0;  // Bytes asked for
+static unsigned int kmalloc_rounded = 0;    // Bytes handed out by the size classes
+
+/* Add a slab to the front of a cache list */
+static void slab_list_add(slab_t** list, slab_t* slab) {
+    slab->prev = 0;
+    slab->next = *list;
+    if (*list) {
+        (*list)->prev = slab;
+    }
+    *list = slab;
+}
+
+/* Unlink a slab from a cache list */
+static void slab_list_remove(slab_t** list, slab_t* slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        *list = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    slab->next = 0;
+    slab->prev = 0;
+}
+
+/* Set up a cache descriptor. Slabs grow in powers of two pages until
+   the header and tail waste is at most 1/8 of the slab. */
+static void cache_init(kmem_cache_t* cache, const char* name, size_t size) {
+    size = (size + 7) & ~7;
+    if (size < SLAB_MIN_SIZE) {
+        size = SLAB_MIN_SIZE;
+    }
+
+    int pages = 1;
+    while (pages < 8) {
+        size_t bytes = pages * PAGE_SIZE;
+        size_t waste = (bytes - SLAB_HEADER_SIZE) % size + SLAB_HEADER_SIZE;
+        if ((bytes - SLAB_HEADER_SIZE) / size > 0 && waste * 8 <= bytes) {
+            break;
+        }
+        pages *= 2;
+    }
+
+    cache->name = name;
+    cache->size = size;
+    cache->slab_pages = pages;
+    cache->objs_per_slab = (pages * PAGE_SIZE - SLAB_HEADER_SIZE) / size;
+    cache->partial = 0;
+    cache->full = 0;
+    cache->empty = 0;
+    cache->num_slabs = 0;
+    cache->num_empty = 0;
+    cache->live_objects = 0;
+
+    cache->next = cache_chain;
+    cache_chain = cache;
+}
+
+/* Allocate a new slab for a cache and thread its objects onto the freelist */
+static slab_t* slab_grow(kmem_cache_t* cache) {
+    // Objects are initialised by their users, no need to zero the pages
+    slab_t* slab = (slab_t*)page_alloc_flags(cache->slab_pages, PAGE_NOZERO);
+    if (slab == 0) {
+        return 0;
+    }
+    page_set_owner(slab, slab);
+
+    slab->cache = cache;
+    slab->inuse = 0;
+    slab->freelist = 0;
+
+    // Link objects back to front so the freelist hands them out in order
+    unsigned char* objs = (unsigned char*)slab + SLAB_HEADER_SIZE;
+    for (int i = cache->objs_per_slab - 1; i >= 0; i--) {
+        void** obj = (void**)(objs + i * cache->size);
+        *obj = slab->freelist;
+        slab->freelist = obj;
+    }
+
+    cache->num_slabs++;
+    return slab;
+}
+
+/* Hand a slab's pages back to the page allocator */
+static void slab_release(kmem_cache_t* cache, slab_t* slab) {
+    page_set_owner(slab, 0);
+    page_free(slab);
+    cache->num_slabs--;
+}
+
+/* Create a cache for fixed-size objects */
+kmem_cache_t* kmem_cache_create(const char* name, size_t size) {
+    if (size == 0 || size > SLAB_MAX_SIZE) {
+        return 0;
+    }
+
+    kmem_cache_t* cache = (kmem_cache_t*)kmem_cache_alloc(&cache_cache);
+    if (cache == 0) {
+        return 0;
+    }
+
+    unsigned int flags = spin_lock_irqsave(&slab_lock);
+    cache_init(cache, name, size);
+    spin_unlock_irqrestore(&slab_lock, flags);
+    return cache;
+}
+
+/* Destroy a cache - all of its objects must have been freed */
+void kmem_cache_destroy(kmem_cache_t* cache) {
+    if (cache == 0) return;
+
+    unsigned int flags = spin_lock_irqsave(&slab_lock);
+    if (cache->partial || cache->full) {
+        spin_unlock_irqrestore(&slab_lock, flags);
+        print("ERROR: kmem_cache_destroy() on a cache with live objects\n");
+        return;
+    }
+
+    while (cache->empty) {
+        slab_t* slab = cache->empty;
+        slab_list_remove(&cache->empty, slab);
+        slab_release(cache, slab);
+    }
+
+    // Unlink from the cache chain
+    kmem_cache_t** link = &cache_chain;
+    while (*link && *link != cache) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        *link = cache->next;
+    }
+    spin_unlock_irqrestore(&slab_lock, flags);
+
+    kmem_cache_free(&cache_cache, cache);
+}
+
+/* Pop an object off a cache's lists - slab_lock must be held */
+static void* cache_alloc(kmem_cache_t* cache) {
+    slab_t* slab = cache->partial;
+
+    if (slab == 0) {
+        // Reuse an empty slab before asking for new pages
+        slab = cache->empty;
+        if (slab) {
+            slab_list_remove(&cache->empty, slab);
+            cache->num_empty--;
+        } else {
+            slab = slab_grow(cache);
+            if (slab == 0) {
+                return 0;
+            }
+        }
+        slab_list_add(&cache->partial, slab);
+    }
+
+    // Pop the first free object
+    void** obj = (void**)slab->freelist;
+    slab->freelist = *obj;
+    slab->inuse++;
+    cache->live_objects++;
+
+    if (slab->inuse == cache->objs_per_slab) {
+        slab_list_remove(&cache->partial, slab);
+        slab_list_add(&cache->full, slab);
+    }
+
+    return obj;
+}
+
+/* Allocate one object from a cache */
+void* kmem_cache_alloc(kmem_cache_t* cache) {
+    unsigned int flags = spin_lock_irqsave(&slab_lock);
+    void* obj = cache_alloc(cache);
+    spin_unlock_irqrestore(&slab_lock, flags);
+    return obj;
+}
+
+/* Put an object back on its slab - slab_lock must be held */
+static void cache_free(kmem_cache_t* cache, void* obj) {
+    if (obj == 0) return;
+
+    slab_t* slab = (slab_t*)page_get_owner(obj);
+    if (slab == 0 || slab->cache != cache) {
+        print("ERROR: kmem_cache_free() of an object not from this cache\n");
+        return;
+    }
+
+    unsigned int offset = (unsigned int)obj - (unsigned int)slab - SLAB_HEADER_SIZE;
+    if (offset % cache->size != 0) {
+        print("ERROR: kmem_cache_free() of a misaligned object\n");
+        return;
+    }
+
+    if (slab->inuse == cache->objs_per_slab) {
+        slab_list_remove(&cache->full, slab);
+        slab_list_add(&cache->partial, slab);
+    }
+
+    // Push onto the slab's freelist
+    *(void**)obj = slab->freelist;
+    slab->freelist = obj;
+    slab->inuse--;
+    cache->live_objects--;
+
+    if (slab->inuse == 0) {
+        slab_list_remove(&cache->partial, slab);
+        if (cache->num_empty < SLAB_MAX_EMPTY) {
+            slab_list_add(&cache->empty, slab);
+            cache->num_empty++;
+        } else {
+            slab_release(cache, slab);
+        }
+    }
+}
+
+/* Return an object to its cache */
+void kmem_cache_free(kmem_cache_t* cache, void* obj) {
+    unsigned int flags = spin_lock_irqsave(&slab_lock);
+    cache_free(cache, obj);
+    spin_unlock_irqrestore(&slab_lock, flags);
+}
+
+/* Set up the descriptor cache and the kmalloc() size classes */
+void init_slab() {
+    cache_chain = 0;
+    kmalloc_requested = 0;
+    kmalloc_rounded = 0;
+
+    for (int i = SLAB_NUM_CLASSES - 1; i >= 0; i--) {
+        cache_init(&size_caches[i], size_cache_names[i], 1 << (i + SLAB_MIN_SHIFT));
+    }
+    cache_init(&cache_cache, "kmem_cache", sizeof(kmem_cache_t));
+}
+
+/* Size class index for a request */
+static int size_class(size_t size) {
+    int shift = SLAB_MIN_SHIFT;
+    while ((1u << shift) < size) {
+        shift++;
+    }
+    return shift - SLAB_MIN_SHIFT;
+}
+
+/* Allocate a small object from the matching size class */
+void* slab_alloc(size_t size) {
+    if (size == 0 || size > SLAB_MAX_SIZE) {
+        return 0;
+    }
+
+    kmem_cache_t* cache = &size_caches[size_class(size)];
+    void* obj = kmem_cache_alloc(cache);
+    if (obj) {
+        // Other CPUs update these without slab_lock
+        __sync_fetch_and_add(&kmalloc_requested, size);
+        __sync_fetch_and_add(&kmalloc_rounded, cache->size);
+    }
+    return obj;
+}
+
+/* Free ptr if it belongs to a slab - returns 0 for page allocations */
+int slab_free(void* ptr) {
+    slab_t* slab = (slab_t*)page_get_owner(ptr);
+    if (slab == 0) {
+        return 0;
+    }
+
+    kmem_cache_free(slab->cache, ptr);
+    return 1;
+}
+
+/* Percentage of a in b, without overflowing 32 bits */
+static int percent_of(unsigned int a, unsigned int b) {
+    if (b == 0) return 0;
+    if (b >= 0x1000000) return a / (b / 100);
+    return a * 100 / b;
+}
+
+/* Print per-cache usage and the kmalloc() memory efficiency */
+void print_slab_stats() {
+    unsigned int object_bytes = 0;
+    unsigned int slab_bytes = 0;
+
+    print("\nSlab Caches:\n");
+    for (kmem_cache_t* cache = cache_chain; cache; cache = cache->next) {
+        if (cache->num_slabs == 0) continue;
+
+        kprintf("  %s: %u objects in %d slabs (%d KB)\n", cache->name, cache->live_objects,
+                cache->num_slabs, cache->num_slabs * cache->slab_pages * PAGE_SIZE / 1024);
+
+        object_bytes += cache->live_objects * cache->size;
+        slab_bytes += cache->num_slabs * cache->slab_pages * PAGE_SIZE;
+    }
+
+    kprintf("  Objects in use: %u bytes of %u bytes in slabs (%d%%)\n",
+            object_bytes, slab_bytes, percent_of(object_bytes, slab_bytes));
+    kprintf("  kmalloc requested: %u bytes, consumed: %u bytes (%d%% efficient)\n",
+            kmalloc_requested, kmalloc_rounded, percent_of(kmalloc_requested, kmalloc_rounded));
+}
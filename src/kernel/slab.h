@@ -0,0 +1,54 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include "memory.h"
+
+/* Size classes served by kmalloc() - powers of two from 8 to 2048 bytes */
+#define SLAB_MIN_SHIFT   3
+#define SLAB_MAX_SHIFT   11
+#define SLAB_NUM_CLASSES (SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+#define SLAB_MIN_SIZE    (1 << SLAB_MIN_SHIFT)
+#define SLAB_MAX_SIZE    (1 << SLAB_MAX_SHIFT)
+
+/* Empty slabs kept per cache before pages go back to the page allocator */
+#define SLAB_MAX_EMPTY 1
+
+struct kmem_cache;
+
+/* Slab header - stored at the start of each slab's first page */
+typedef struct slab {
+    struct slab* next;          // Next slab on the same cache list
+    struct slab* prev;          // Previous slab on the same cache list
+    struct kmem_cache* cache;   // Owning cache
+    void* freelist;             // First free object, linked through the objects
+    int inuse;                  // Objects handed out from this slab
+} slab_t;
+
+/* Object cache - a set of slabs holding objects of one size */
+typedef struct kmem_cache {
+    const char* name;
+    size_t size;                // Object size (multiple of 8)
+    int slab_pages;             // Pages per slab
+    int objs_per_slab;          // Objects per slab
+    slab_t* partial;            // Slabs with free and used objects
+    slab_t* full;               // Slabs with no free objects
+    slab_t* empty;              // Slabs with no used objects
+    int num_slabs;              // Slabs on all three lists
+    int num_empty;              // Slabs on the empty list
+    unsigned int live_objects;  // Objects currently allocated
+    struct kmem_cache* next;    // Next cache in the global cache chain
+} kmem_cache_t;
+
+/* Object cache API */
+kmem_cache_t* kmem_cache_create(const char* name, size_t size);
+void kmem_cache_destroy(kmem_cache_t* cache);
+void* kmem_cache_alloc(kmem_cache_t* cache);
+void kmem_cache_free(kmem_cache_t* cache, void* obj);
+
+/* kmalloc() backend */
+void init_slab();
+void* slab_alloc(size_t size);      /* Allocate from the matching size class */
+int slab_free(void* ptr);           /* Returns 1 if ptr was a slab object */
+void print_slab_stats();
+
+#endif /* SLAB_H */
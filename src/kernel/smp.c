@@ -0,0 +1,540 @@
+/* smp.c - Application processor start-up, local APIC and per-CPU data */
+#include "smp.h"
+#include "memory.h"
+#include "paging.h"
+#include "idt.h"
+#include "clock.h"
+#include "string.h"
+#include "spinlock.h"
+#include "cpu.h"
+#include "kprintf.h"
+
+/* Forward declaration of print function */
+void print(const char *str);
+
+/* Real mode start-up code (trampoline.asm), copied to SMP_TRAMPOLINE */
+extern char trampoline_start[];
+extern char trampoline_end[];
+extern char trampoline_params[];
+
+/* Filled in before each startup IPI and read by the trampoline */
+typedef struct {
+    unsigned int stack;         // Initial esp
+    unsigned int entry;         // ap_main()
+    unsigned int cpu;           // cpu_t* passed to the entry
+} trampoline_params_t;
+
+/* ACPI root system description pointer */
+typedef struct {
+    char signature[8];          // "RSD PTR "
+    unsigned char checksum;     // Over the first 20 bytes
+    char oem_id[6];
+    unsigned char revision;
+    unsigned int rsdt;
+} __attribute__((packed)) acpi_rsdp_t;
+
+/* Header shared by every ACPI table */
+typedef struct {
+    char signature[4];
+    unsigned int length;        // Including the header
+    unsigned char revision;
+    unsigned char checksum;     // Over the whole table
+    char oem_id[6];
+    char oem_table_id[8];
+    unsigned int oem_revision;
+    unsigned int creator_id;
+    unsigned int creator_revision;
+} __attribute__((packed)) acpi_header_t;
+
+/* Multiple APIC description table ("APIC"), variable length entries follow */
+typedef struct {
+    acpi_header_t header;
+    unsigned int lapic_addr;
+    unsigned int flags;
+} __attribute__((packed)) acpi_madt_t;
+
+#define RSDP_CHECKSUM_LEN   20
+#define MADT_LAPIC          0       /* Entry type: processor local APIC */
+#define MADT_IOAPIC         1       /* Entry type: I/O APIC */
+#define MADT_LAPIC_ENABLED  0x01
+#define CPUID_FEAT_EDX_APIC (1 << 9)
+
+static cpu_t cpus[SMP_MAX_CPUS];
+static int cpu_count = 1;           // Listed in the MADT, always the boot CPU
+static int cpus_ignored = 0;        // Past SMP_MAX_CPUS
+static int cpus_online = 1;
+static int percpu_ready = 0;        // %gs holds the per-CPU segment
+static int madt_found = 0;
+static unsigned int lapic_base = LAPIC_DEFAULT_BASE;
+static unsigned int ioapic_base = 0;
+static volatile unsigned int* lapic = 0;
+static spinlock_t call_lock = SPINLOCK_INIT;   // One smp_call() at a time
+
+/* Whether the bytes of a table add up to 0 */
+static int checksum_ok(void* table, unsigned int length) {
+    unsigned char sum = 0;
+
+    for (unsigned int i = 0; i < length; i++) {
+        sum += ((unsigned char*)table)[i];
+    }
+    return sum == 0;
+}
+
+static int signature_is(const char* found, const char* expected, int length) {
+    return strncmp(found, expected, length) == 0;
+}
+
+/* Search [start, end) on 16-byte boundaries for the RSDP */
+static acpi_rsdp_t* find_rsdp(unsigned int start, unsigned int end) {
+    for (unsigned int addr = start; addr + sizeof(acpi_rsdp_t) <= end; addr += 16) {
+        acpi_rsdp_t* rsdp = (acpi_rsdp_t*)addr;
+        if (signature_is(rsdp->signature, "RSD PTR ", 8) &&
+            checksum_ok(rsdp, RSDP_CHECKSUM_LEN)) {
+            return rsdp;
+        }
+    }
+    return 0;
+}
+
+/* Record the enabled processors and the first I/O APIC */
+static void parse_madt(acpi_madt_t* madt) {
+    unsigned char* entry = (unsigned char*)(madt + 1);
+    unsigned char* end = (unsigned char*)madt + madt->header.length;
+
+    madt_found = 1;
+    lapic_base = madt->lapic_addr;
+    cpu_count = 0;
+
+    // Each entry starts with its type and length
+    while (entry + 2 <= end && entry[1] >= 2 && entry + entry[1] <= end) {
+        if (entry[0] == MADT_LAPIC && (*(unsigned int*)(entry + 4) & MADT_LAPIC_ENABLED)) {
+            if (cpu_count < SMP_MAX_CPUS) {
+                cpus[cpu_count].apic_id = entry[3];
+                cpu_count++;
+            } else {
+                cpus_ignored++;
+            }
+        } else if (entry[0] == MADT_IOAPIC && ioapic_base == 0) {
+            ioapic_base = *(unsigned int*)(entry + 4);
+        }
+        entry += entry[1];
+    }
+
+    if (cpu_count == 0) {
+        cpu_count = 1;
+    }
+}
+
+/* Find the processors in the ACPI MADT. The RSDP is in the first KB of
+   the EBDA or the BIOS area at 0xE0000, and the EBDA segment is kept at
+   0x40E in page 0 - so this runs before paging unmaps it. */
+void smp_detect() {
+    unsigned int ebda = (unsigned int)*(volatile unsigned short*)0x40E << 4;
+    acpi_rsdp_t* rsdp = 0;
+
+    if (ebda >= 0x80000 && ebda < 0xA0000) {
+        rsdp = find_rsdp(ebda, ebda + 1024);
+    }
+    if (rsdp == 0) {
+        rsdp = find_rsdp(0xE0000, 0x100000);
+    }
+    if (rsdp == 0) {
+        return;
+    }
+
+    acpi_header_t* rsdt = (acpi_header_t*)rsdp->rsdt;
+    if (!signature_is(rsdt->signature, "RSDT", 4) || !checksum_ok(rsdt, rsdt->length)) {
+        return;
+    }
+
+    unsigned int* tables = (unsigned int*)(rsdt + 1);
+    int num_tables = (rsdt->length - sizeof(acpi_header_t)) / 4;
+    for (int i = 0; i < num_tables; i++) {
+        acpi_header_t* table = (acpi_header_t*)tables[i];
+        if (signature_is(table->signature, "APIC", 4) && checksum_ok(table, table->length)) {
+            parse_madt((acpi_madt_t*)table);
+            return;
+        }
+    }
+}
+
+/* Local APIC register access */
+static inline unsigned int lapic_read(unsigned int reg) {
+    return lapic[reg / 4];
+}
+
+static inline void lapic_write(unsigned int reg, unsigned int value) {
+    lapic[reg / 4] = value;
+}
+
+/* Software-enable this CPU's local APIC */
+static void lapic_enable() {
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+}
+
+/* Send an IPI and wait for the target to accept it. Interrupts stay off
+   so nothing else on this CPU writes the ICR in between. */
+static void lapic_send_ipi(int apic_id, unsigned int command) {
+    unsigned int flags = irq_save();
+
+    lapic_write(LAPIC_ICR_HIGH, (unsigned int)apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, command);
+    while (lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING) {
+        __asm__ volatile("pause");
+    }
+
+    irq_restore(flags);
+}
+
+/* The IPI only wakes the CPU from hlt; its work is picked up after */
+static void ipi_handler(interrupt_frame_t* frame) {
+    (void)frame;
+    lapic_write(LAPIC_EOI, 0);
+}
+
+/* Encode a GDT descriptor */
+static void gdt_set(cpu_t* cpu, int index, unsigned int base, unsigned int limit,
+                    unsigned char access, unsigned char flags) {
+    unsigned long long entry = limit & 0xFFFF;
+
+    entry |= (unsigned long long)(base & 0xFFFFFF) << 16;
+    entry |= (unsigned long long)access << 40;
+    entry |= (unsigned long long)((limit >> 16) & 0xF) << 48;
+    entry |= (unsigned long long)(flags & 0xF) << 52;
+    entry |= (unsigned long long)(base >> 24) << 56;
+    cpu->gdt[index] = entry;
+}
+
+/* Give the running CPU its own GDT and TSS and point %gs at its cpu_t */
+static void cpu_load(cpu_t* cpu, unsigned int stack_top) {
+    struct {
+        unsigned short limit;
+        unsigned int base;
+    } __attribute__((packed)) gdt_ptr;
+
+    cpu->self = cpu;
+    gdt_set(cpu, 0, 0, 0, 0, 0);
+    gdt_set(cpu, 1, 0, 0xFFFFF, 0x9A, 0xC);    // Flat code, 4 KB granularity
+    gdt_set(cpu, 2, 0, 0xFFFFF, 0x92, 0xC);    // Flat data
+    gdt_set(cpu, 3, (unsigned int)&cpu->tss, sizeof(tss_t) - 1, 0x89, 0x0);
+    gdt_set(cpu, 4, (unsigned int)cpu, sizeof(cpu_t) - 1, 0x92, 0x4);
+
+    memset(&cpu->tss, 0, sizeof(tss_t));
+    cpu->tss.ss0 = GDT_KERNEL_DATA;
+    cpu->tss.esp0 = stack_top;
+    cpu->tss.iomap_base = sizeof(tss_t);       // No I/O permission map
+
+    gdt_ptr.limit = sizeof(cpu->gdt) - 1;
+    gdt_ptr.base = (unsigned int)cpu->gdt;
+    __asm__ volatile("lgdt %0" : : "m"(gdt_ptr));
+
+    // Reload every segment register from the new table
+    __asm__ volatile("ljmp %0, $1f\n1:" : : "i"(GDT_KERNEL_CODE));
+    __asm__ volatile("mov %0, %%ds\n\t"
+                     "mov %0, %%es\n\t"
+                     "mov %0, %%fs\n\t"
+                     "mov %0, %%ss"
+                     : : "r"((unsigned short)GDT_KERNEL_DATA));
+    __asm__ volatile("mov %0, %%gs" : : "r"((unsigned short)GDT_PERCPU) : "memory");
+    __asm__ volatile("ltr %0" : : "r"((unsigned short)GDT_TSS));
+}
+
+/* Wait for work and run it. The check and the hlt happen with interrupts
+   off until sti, whose one-instruction delay means an IPI sent after the
+   check still wakes the hlt. */
+static void ap_loop(cpu_t* cpu) {
+    while (1) {
+        __asm__ volatile("cli" : : : "memory");
+        smp_func_t func = cpu->work;
+        if (func == 0) {
+            __asm__ volatile("sti; hlt" : : : "memory");
+            continue;
+        }
+        __asm__ volatile("sti" : : : "memory");
+
+        func(cpu->work_arg);
+        cpu->calls++;
+        __asm__ volatile("" : : : "memory");
+        cpu->work = 0;
+    }
+}
+
+/* First C code on an application processor, called by the trampoline in
+   protected mode with paging off */
+static void ap_main(cpu_t* cpu) {
+    cpu_load(cpu, (unsigned int)cpu->stack + SMP_STACK_PAGES * PAGE_SIZE);
+    idt_load();
+    paging_init_ap();
+
+    // Same SSE setup as init_string() on the boot CPU
+    if (string_has_sse2()) {
+        write_cr0((read_cr0() & ~CR0_EM) | CR0_MP);
+        write_cr4(read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+    }
+
+    lapic_enable();
+    __sync_fetch_and_add(&cpus_online, 1);
+    cpu->online = 1;
+
+    ap_loop(cpu);
+}
+
+/* INIT, then two startup IPIs as the MP specification asks. Returns 0 if
+   the AP does not come online in time. */
+static int start_ap(cpu_t* cpu) {
+    cpu->stack = page_alloc_multiple(SMP_STACK_PAGES);
+    if (cpu->stack == 0) {
+        return 0;
+    }
+
+    trampoline_params_t* params = (trampoline_params_t*)
+        (SMP_TRAMPOLINE + (trampoline_params - trampoline_start));
+    params->stack = (unsigned int)cpu->stack + SMP_STACK_PAGES * PAGE_SIZE;
+    params->entry = (unsigned int)ap_main;
+    params->cpu = (unsigned int)cpu;
+
+    lapic_send_ipi(cpu->apic_id, LAPIC_ICR_INIT | LAPIC_ICR_ASSERT);
+    delay_us(10000);
+    for (int i = 0; i < 2 && !cpu->online; i++) {
+        lapic_send_ipi(cpu->apic_id, LAPIC_ICR_STARTUP | LAPIC_ICR_ASSERT | (SMP_TRAMPOLINE >> 12));
+        delay_us(200);
+    }
+
+    // A late AP still uses its stack, so it is not freed on a timeout
+    unsigned long long deadline = clock_ns() + (unsigned long long)SMP_START_TIMEOUT_MS * 1000000;
+    while (!cpu->online && clock_ns() < deadline) {
+        __asm__ volatile("pause");
+    }
+    return cpu->online;
+}
+
+/* Set up the boot CPU's per-CPU data and local APIC, then start every
+   other processor found by smp_detect(). Needs paging, the clock and
+   interrupts set up. */
+void init_smp() {
+    cpu_t* bsp = &cpus[0];
+    unsigned int eax, ebx, ecx, edx = 0;
+
+    if (cpuid_supported()) {
+        cpuid(1, &eax, &ebx, &ecx, &edx);
+    }
+    if (!(edx & CPUID_FEAT_EDX_APIC) || !paging_map_mmio(lapic_base, PAGE_SIZE)) {
+        cpu_count = 1;
+        bsp->apic_id = 0;
+    } else {
+        lapic = (volatile unsigned int*)lapic_base;
+        int bsp_apic = lapic_read(LAPIC_ID) >> 24;
+
+        // The boot CPU goes first, wherever the MADT lists it
+        int i = 0;
+        while (i < cpu_count && cpus[i].apic_id != bsp_apic) {
+            i++;
+        }
+        if (i == cpu_count) {
+            cpu_count = 1;
+            i = 0;
+        }
+        cpus[i].apic_id = cpus[0].apic_id;
+        bsp->apic_id = bsp_apic;
+    }
+
+    for (int i = 0; i < cpu_count; i++) {
+        cpus[i].id = i;
+    }
+    cpu_load(bsp, 0);
+    bsp->online = 1;
+    percpu_ready = 1;
+
+    if (lapic == 0) {
+        print("SMP: no local APIC, 1 CPU\n");
+        return;
+    }
+
+    idt_set_gate(LAPIC_SPURIOUS_VECTOR, isr_spurious);
+    register_interrupt_handler(SMP_IPI_VECTOR, ipi_handler);
+    lapic_enable();
+
+    memcpy((void*)SMP_TRAMPOLINE, trampoline_start, trampoline_end - trampoline_start);
+    for (int i = 1; i < cpu_count; i++) {
+        if (!start_ap(&cpus[i])) {
+            kprintf("ERROR: CPU %d did not start\n", i);
+        }
+    }
+
+    kprintf("SMP: %d of %d %s online\n", cpus_online, cpu_count, cpu_count == 1 ? "CPU" : "CPUs");
+}
+
+/* CPUs online */
+int smp_cpu_count() {
+    return cpus_online;
+}
+
+/* Per-CPU data of the running CPU */
+cpu_t* smp_this_cpu() {
+    cpu_t* cpu;
+
+    if (!percpu_ready) {
+        return &cpus[0];
+    }
+    __asm__ volatile("mov %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+/* Index of the running CPU */
+int smp_cpu_id() {
+    return smp_this_cpu()->id;
+}
+
+/* Run func(arg) on a CPU - directly when it is this one, otherwise by
+   handing it over and sending an IPI. Returns 0 if the CPU is offline
+   or still busy with earlier work. */
+int smp_call(int id, smp_func_t func, void* arg) {
+    if (id < 0 || id >= cpu_count || !cpus[id].online) {
+        return 0;
+    }
+
+    cpu_t* cpu = &cpus[id];
+    if (cpu == smp_this_cpu()) {
+        func(arg);
+        cpu->calls++;
+        return 1;
+    }
+
+    unsigned int flags = spin_lock_irqsave(&call_lock);
+    if (cpu->work) {
+        spin_unlock_irqrestore(&call_lock, flags);
+        return 0;
+    }
+    cpu->work_arg = arg;
+    __asm__ volatile("" : : : "memory");
+    cpu->work = func;
+    spin_unlock_irqrestore(&call_lock, flags);
+
+    lapic_send_ipi(cpu->apic_id, LAPIC_ICR_ASSERT | SMP_IPI_VECTOR);
+    return 1;
+}
+
+/* Wait until a CPU has finished the work given by smp_call() */
+void smp_wait(int id) {
+    if (id < 0 || id >= cpu_count) {
+        return;
+    }
+    while (cpus[id].work) {
+        __asm__ volatile("pause" : : : "memory");
+    }
+}
+
+/* List the processors and their state */
+void print_smp_info() {
+    print("\nSMP:\n");
+    kprintf("  CPUs: %d online of %d%s", cpus_online, cpu_count,
+            madt_found ? " in the ACPI MADT" : " (no MADT found)");
+    if (cpus_ignored) {
+        kprintf(", %d more ignored", cpus_ignored);
+    }
+    print("\n");
+
+    if (lapic == 0) {
+        print("  No local APIC\n");
+        return;
+    }
+    kprintf("  Local APIC at 0x%08X", lapic_base);
+    if (ioapic_base) {
+        kprintf(", I/O APIC at 0x%08X", ioapic_base);
+    }
+    print("\n");
+
+    for (int i = 0; i < cpu_count; i++) {
+        kprintf("  CPU %d: APIC id %d, %s, %u calls\n", i, cpus[i].apic_id,
+                i == 0 ? "boot CPU" : (cpus[i].online ? "online" : "offline"), cpus[i].calls);
+    }
+    kprintf("  Running on CPU %d\n", smp_cpu_id());
+}
+
+/* Allocate and free pages in batches - run on every CPU at once */
+static void bench_worker(void* arg) {
+    void* pages[SMP_BENCH_BATCH];
+    unsigned int* ops = (unsigned int*)arg;
+
+    *ops = 0;
+    for (int round = 0; round < SMP_BENCH_ROUNDS; round++) {
+        for (int i = 0; i < SMP_BENCH_BATCH; i++) {
+            pages[i] = page_alloc_flags(1, PAGE_NOZERO);
+        }
+        for (int i = 0; i < SMP_BENCH_BATCH; i++) {
+            if (pages[i]) {
+                page_free(pages[i]);
+                *ops += 2;
+            }
+        }
+    }
+}
+
+/* Run bench_worker on the first n online CPUs at once. Returns the
+   time taken and the operations done. */
+static unsigned long long bench_run(int* online, int n, unsigned int* total) {
+    unsigned int ops[SMP_MAX_CPUS];
+    unsigned long long start = clock_ns();
+
+    for (int k = 1; k < n; k++) {
+        smp_call(online[k], bench_worker, &ops[k]);
+    }
+    bench_worker(&ops[0]);
+    for (int k = 1; k < n; k++) {
+        smp_wait(online[k]);
+    }
+    unsigned long long elapsed = clock_ns() - start;
+
+    *total = 0;
+    for (int k = 0; k < n; k++) {
+        *total += ops[k];
+    }
+    return elapsed;
+}
+
+/* Operations per millisecond */
+static int bench_rate(unsigned int total, unsigned long long elapsed) {
+    unsigned int us = (unsigned int)div64_32(elapsed, 1000, 0);
+    if (us == 0) {
+        us = 1;
+    }
+    return (int)div64_32((unsigned long long)total * 1000, us, 0);
+}
+
+/* Page allocator throughput with 1 to N CPUs working at once, going
+   straight to the buddy allocator and then through the page magazines */
+void run_smp_benchmark() {
+    int online[SMP_MAX_CPUS];
+    int num_online = 0;
+    mem_stats_t before, after;
+    unsigned int total;
+
+    for (int i = 0; i < cpu_count; i++) {
+        if (cpus[i].online) {
+            online[num_online++] = i;
+        }
+    }
+
+    kprintf("\nPage alloc/free, %d rounds of %d pages per CPU:\n", SMP_BENCH_ROUNDS, SMP_BENCH_BATCH);
+
+    int was_on = page_magazines_enable(0);
+    for (int n = 1; n <= num_online; n++) {
+        kprintf("  %d %s", n, n == 1 ? "CPU:  " : "CPUs: ");
+
+        page_magazines_enable(0);
+        unsigned long long elapsed = bench_run(online, n, &total);
+        kprintf("buddy %d ops/ms, ", bench_rate(total, elapsed));
+
+        page_magazines_enable(1);
+        mem_get_stats(&before);
+        elapsed = bench_run(online, n, &total);
+        mem_get_stats(&after);
+        unsigned int hits = after.magazine_hits - before.magazine_hits;
+        unsigned int misses = after.magazine_misses - before.magazine_misses;
+        kprintf("magazines %d ops/ms (%u%% hits, %u refills, %u contended)\n",
+                bench_rate(total, elapsed), hits + misses ? hits * 100 / (hits + misses) : 0,
+                after.magazine_refills - before.magazine_refills,
+                after.magazine_contended - before.magazine_contended);
+    }
+    page_magazines_enable(was_on);
+}
@@ -0,0 +1,79 @@
+#ifndef SMP_H
+#define SMP_H
+
+/* Application processors start in real mode at this page, reserved by
+   init_memory() below the kernel */
+#define SMP_TRAMPOLINE      0x8000
+#define SMP_MAX_CPUS        8
+#define SMP_STACK_PAGES     4       /* 16 KB per AP, the same as the boot stack */
+#define SMP_START_TIMEOUT_MS 100    /* Wait for an AP to come online */
+#define SMP_IPI_VECTOR      48      /* Wakes an AP to run its work (isr.asm) */
+
+/* Local APIC registers, offsets from its MMIO base */
+#define LAPIC_DEFAULT_BASE  0xFEE00000
+#define LAPIC_ID            0x020
+#define LAPIC_EOI           0x0B0
+#define LAPIC_SVR           0x0F0   /* Spurious vector and software enable */
+#define LAPIC_ICR_LOW       0x300
+#define LAPIC_ICR_HIGH      0x310
+#define LAPIC_SVR_ENABLE    0x100
+#define LAPIC_SPURIOUS_VECTOR 0xFF
+#define LAPIC_ICR_INIT      0x00000500
+#define LAPIC_ICR_STARTUP   0x00000600
+#define LAPIC_ICR_PENDING   0x00001000  /* Delivery status: not yet accepted */
+#define LAPIC_ICR_ASSERT    0x00004000
+
+/* Per-CPU GDT. The flat segments keep the boot sector's selectors. */
+#define GDT_ENTRIES         5
+#define GDT_KERNEL_CODE     0x08
+#define GDT_KERNEL_DATA     0x10
+#define GDT_TSS             0x18
+#define GDT_PERCPU          0x20    /* Loaded in %gs, based at this CPU's cpu_t */
+
+/* Parallel page allocator benchmark */
+#define SMP_BENCH_ROUNDS    2000
+#define SMP_BENCH_BATCH     16      /* Pages held at once by each CPU */
+
+/* 32-bit task state segment. Nothing runs outside ring 0, so only the
+   ring 0 stack and the I/O map offset are filled in. */
+typedef struct {
+    unsigned int prev_task;
+    unsigned int esp0, ss0;
+    unsigned int esp1, ss1;
+    unsigned int esp2, ss2;
+    unsigned int cr3, eip, eflags;
+    unsigned int eax, ecx, edx, ebx, esp, ebp, esi, edi;
+    unsigned int es, cs, ss, ds, fs, gs;
+    unsigned int ldt;
+    unsigned short trap;
+    unsigned short iomap_base;
+} __attribute__((packed)) tss_t;
+
+typedef void (*smp_func_t)(void* arg);
+
+/* Per-CPU data, reached through %gs on its own CPU */
+typedef struct cpu {
+    struct cpu* self;               // %gs:0 - must stay first
+    int id;                         // Index in cpus[], 0 is the boot CPU
+    int apic_id;
+    volatile int online;
+    void* stack;                    // Bottom of the stack, 0 for the boot CPU
+    volatile smp_func_t work;       // Set by smp_call(), cleared once it has run
+    void* work_arg;
+    unsigned int calls;             // Work items run
+    unsigned long long gdt[GDT_ENTRIES] __attribute__((aligned(8)));
+    tss_t tss;
+} cpu_t;
+
+/* Function prototypes */
+void smp_detect();                  /* Read the MADT - before paging unmaps page 0 */
+void init_smp();                    /* Start the application processors */
+int smp_cpu_count();                /* CPUs online */
+int smp_cpu_id();                   /* 0 on the boot CPU */
+cpu_t* smp_this_cpu();
+int smp_call(int id, smp_func_t func, void* arg);   /* 0 if the CPU is offline or busy */
+void smp_wait(int id);              /* Until the CPU has finished its work */
+void print_smp_info();
+void run_smp_benchmark();
+
+#endif /* SMP_H */
@@ -0,0 +1,50 @@
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include "cpu.h"
+
+/* Ticket lock - CPUs get the lock in the order they asked for it, so
+   none of them can be starved by the others */
+typedef struct {
+    volatile unsigned short next;   // Ticket for the next CPU to ask
+    volatile unsigned short owner;  // Ticket now holding the lock
+} spinlock_t;
+
+#define SPINLOCK_INIT { 0, 0 }
+
+/* Take a ticket and wait for it to come up */
+static inline void spin_lock(spinlock_t* lock) {
+    unsigned short ticket = __sync_fetch_and_add(&lock->next, 1);
+    while (lock->owner != ticket) {
+        __asm__ volatile("pause" : : : "memory");
+    }
+    // Nothing from the critical section may move above this point
+    __asm__ volatile("" : : : "memory");
+}
+
+/* Serve the next ticket. x86 does not reorder a store before earlier
+   loads and stores, so only the compiler needs holding back. */
+static inline void spin_unlock(spinlock_t* lock) {
+    __asm__ volatile("" : : : "memory");
+    lock->owner = lock->owner + 1;
+}
+
+/* Whether some CPU holds the lock */
+static inline int spin_is_locked(spinlock_t* lock) {
+    return lock->next != lock->owner;
+}
+
+/* Lock with interrupts off, so an interrupt handler on this CPU can never
+   spin on a lock its own CPU holds */
+static inline unsigned int spin_lock_irqsave(spinlock_t* lock) {
+    unsigned int flags = irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t* lock, unsigned int flags) {
+    spin_unlock(lock);
+    irq_restore(flags);
+}
+
+#endif /* SPINLOCK_H */
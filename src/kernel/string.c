@@ -0,0 +1,333 @@
+/* string.c - Kernel memory and string primitives */
+#include "string.h"
+#include "cpu.h"
+#include "kprintf.h"
+
+/* Forward declaration of print function */
+void print(const char *str);
+
+/* SSE2 streaming loops (string_sse.asm) - dst 16-byte aligned, n % 64 == 0 */
+void memset_sse2_nt(void* dst, int value, size_t n);
+void memcpy_sse2_nt(void* dst, const void* src, size_t n);
+
+/* Variants picked by init_string() for large and non-temporal requests */
+static void* memset_rep(void* dst, int value, size_t n);
+static void* memcpy_rep(void* dst, const void* src, size_t n);
+static void* (*memset_large)(void*, int, size_t) = memset_rep;
+static void* (*memcpy_large)(void*, const void*, size_t) = memcpy_rep;
+
+static int has_sse2 = 0;
+
+/* Byte with the high bit set for every zero byte in a word */
+#define HAS_ZERO_BYTE(x) (((x) - 0x01010101) & ~(x) & 0x80808080)
+
+/* Fill with rep stosd, then rep stosb for the tail */
+static void* memset_rep(void* dst, int value, size_t n) {
+    void* d = dst;
+    unsigned int pattern = (unsigned char)value * 0x01010101;
+    size_t words = n >> 2;
+    size_t bytes = n & 3;
+
+    __asm__ volatile("rep stosl"
+                     : "+D"(d), "+c"(words)
+                     : "a"(pattern)
+                     : "memory");
+    __asm__ volatile("rep stosb"
+                     : "+D"(d), "+c"(bytes)
+                     : "a"(pattern)
+                     : "memory");
+    return dst;
+}
+
+/* Copy forwards with rep movsd, then rep movsb for the tail */
+static void* memcpy_rep(void* dst, const void* src, size_t n) {
+    void* d = dst;
+    size_t words = n >> 2;
+    size_t bytes = n & 3;
+
+    __asm__ volatile("rep movsl"
+                     : "+D"(d), "+S"(src), "+c"(words)
+                     : : "memory");
+    __asm__ volatile("rep movsb"
+                     : "+D"(d), "+S"(src), "+c"(bytes)
+                     : : "memory");
+    return dst;
+}
+
+/* Streaming fill: align dst to 16 bytes, stream the middle, finish the tail */
+static void* memset_sse2(void* dst, int value, size_t n) {
+    unsigned char* d = (unsigned char*)dst;
+
+    size_t head = (16 - ((unsigned int)d & 15)) & 15;
+    if (head > n) head = n;
+    memset_rep(d, value, head);
+    d += head;
+    n -= head;
+
+    size_t body = n & ~63;
+    memset_sse2_nt(d, value, body);
+    memset_rep(d + body, value, n - body);
+    return dst;
+}
+
+/* Streaming copy: align dst to 16 bytes, stream the middle, finish the tail */
+static void* memcpy_sse2(void* dst, const void* src, size_t n) {
+    unsigned char* d = (unsigned char*)dst;
+    const unsigned char* s = (const unsigned char*)src;
+
+    size_t head = (16 - ((unsigned int)d & 15)) & 15;
+    if (head > n) head = n;
+    memcpy_rep(d, s, head);
+    d += head;
+    s += head;
+    n -= head;
+
+    size_t body = n & ~63;
+    memcpy_sse2_nt(d, s, body);
+    memcpy_rep(d + body, s + body, n - body);
+    return dst;
+}
+
+/* Detect SSE2, enable it in CR0/CR4 and select the streaming variants */
+void init_string() {
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!cpuid_supported()) {
+        return;
+    }
+
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    if ((edx & CPUID_FEAT_EDX_SSE2) && (edx & CPUID_FEAT_EDX_FXSR)) {
+        write_cr0((read_cr0() & ~CR0_EM) | CR0_MP);
+        write_cr4(read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+
+        memset_large = memset_sse2;
+        memcpy_large = memcpy_sse2;
+        has_sse2 = 1;
+    }
+}
+
+/* Whether the SSE2 variants are in use */
+int string_has_sse2() {
+    return has_sse2;
+}
+
+/* Fill memory */
+void* memset(void* dst, int value, size_t n) {
+    if (n >= STRING_NT_THRESHOLD) {
+        return memset_large(dst, value, n);
+    }
+    return memset_rep(dst, value, n);
+}
+
+/* Fill memory without pulling it into the cache, for memory that will not
+   be touched again soon (pre-zeroed pages) */
+void* memset_nt(void* dst, int value, size_t n) {
+    return memset_large(dst, value, n);
+}
+
+/* Copy non-overlapping memory */
+void* memcpy(void* dst, const void* src, size_t n) {
+    if (n >= STRING_NT_THRESHOLD) {
+        return memcpy_large(dst, src, n);
+    }
+    return memcpy_rep(dst, src, n);
+}
+
+/* Copy memory that may overlap */
+void* memmove(void* dst, const void* src, size_t n) {
+    unsigned char* d = (unsigned char*)dst;
+    const unsigned char* s = (const unsigned char*)src;
+
+    // Forward copy is safe unless dst starts inside src
+    if (d <= s || d >= s + n) {
+        return memcpy_rep(dst, src, n);
+    }
+
+    // Copy backwards: the odd tail bytes first, then whole words
+    size_t words = n >> 2;
+    size_t bytes = n & 3;
+    d += n - 1;
+    s += n - 1;
+    __asm__ volatile("std\n\t"
+                     "rep movsb\n\t"
+                     "sub $3, %%edi\n\t"
+                     "sub $3, %%esi\n\t"
+                     "mov %3, %%ecx\n\t"
+                     "rep movsl\n\t"
+                     "cld"
+                     : "+D"(d), "+S"(s), "+c"(bytes)
+                     : "r"(words)
+                     : "memory");
+    return dst;
+}
+
+/* Fill count 16-bit cells (rep stosw) - used for VGA text memory */
+void memsetw(unsigned short* dst, unsigned short value, size_t count) {
+    __asm__ volatile("rep stosw"
+                     : "+D"(dst), "+c"(count)
+                     : "a"(value)
+                     : "memory");
+}
+
+/* Length of a string, testing a word at a time once aligned */
+size_t strlen(const char* str) {
+    const char* p = str;
+
+    while ((unsigned int)p & 3) {
+        if (*p == '\0') return p - str;
+        p++;
+    }
+
+    // Aligned loads never cross into an unmapped page
+    const unsigned int* w = (const unsigned int*)p;
+    while (!HAS_ZERO_BYTE(*w)) {
+        w++;
+    }
+
+    p = (const char*)w;
+    while (*p != '\0') {
+        p++;
+    }
+    return p - str;
+}
+
+/* Compare two strings, a word at a time when they share alignment */
+int strcmp(const char* str1, const char* str2) {
+    if ((((unsigned int)str1 ^ (unsigned int)str2) & 3) == 0) {
+        while ((unsigned int)str1 & 3) {
+            if (*str1 == '\0' || *str1 != *str2) {
+                return *(unsigned char*)str1 - *(unsigned char*)str2;
+            }
+            str1++;
+            str2++;
+        }
+
+        // Skip equal words that hold no terminator
+        const unsigned int* w1 = (const unsigned int*)str1;
+        const unsigned int* w2 = (const unsigned int*)str2;
+        while (*w1 == *w2 && !HAS_ZERO_BYTE(*w1)) {
+            w1++;
+            w2++;
+        }
+        str1 = (const char*)w1;
+        str2 = (const char*)w2;
+    }
+
+    while(*str1 && (*str1 == *str2)) {
+        str1++;
+        str2++;
+    }
+    return *(unsigned char*)str1 - *(unsigned char*)str2;
+}
+
+/* Compare at most n characters of two strings */
+int strncmp(const char* str1, const char* str2, size_t n) {
+    while (n > 0 && *str1 && *str1 == *str2) {
+        str1++;
+        str2++;
+        n--;
+    }
+    return n == 0 ? 0 : *(unsigned char*)str1 - *(unsigned char*)str2;
+}
+
+////////////////////////////////////////////////////
+// Benchmark
+////////////////////////////////////////////////////
+
+#define BENCH_BYTES  (64 * 1024)
+#define BENCH_ROUNDS 16
+
+static volatile int bench_sink;
+
+/* Reference: byte loops like the ones these routines replace */
+static void* memset_bytes(void* dst, int value, size_t n) {
+    unsigned char* d = (unsigned char*)dst;
+    for (size_t i = 0; i < n; i++) d[i] = (unsigned char)value;
+    return dst;
+}
+
+static void* memcpy_bytes(void* dst, const void* src, size_t n) {
+    unsigned char* d = (unsigned char*)dst;
+    const unsigned char* s = (const unsigned char*)src;
+    for (size_t i = 0; i < n; i++) d[i] = s[i];
+    return dst;
+}
+
+static size_t strlen_bytes(const char* str) {
+    size_t n = 0;
+    while (str[n] != '\0') n++;
+    return n;
+}
+
+/* Print bytes per cycle with two decimals */
+static void bench_report(const char* label, unsigned int bytes, unsigned int cycles) {
+    unsigned int hundredths = 0;
+    if (cycles > 0) {
+        hundredths = (bytes >= 0x1000000) ? bytes / (cycles / 100 + 1) : bytes * 100 / cycles;
+    }
+
+    kprintf("  %s: %u.%02u bytes/cycle\n", label, hundredths / 100, hundredths % 100);
+}
+
+/* Time BENCH_ROUNDS calls of a fill variant */
+static unsigned int time_fill(void* (*fn)(void*, int, size_t), void* buf) {
+    unsigned long long t0 = rdtsc();
+    for (int i = 0; i < BENCH_ROUNDS; i++) fn(buf, i, BENCH_BYTES);
+    return (unsigned int)(rdtsc() - t0);
+}
+
+/* Time BENCH_ROUNDS calls of a copy variant */
+static unsigned int time_copy(void* (*fn)(void*, const void*, size_t), void* dst, void* src) {
+    unsigned long long t0 = rdtsc();
+    for (int i = 0; i < BENCH_ROUNDS; i++) fn(dst, src, BENCH_BYTES);
+    return (unsigned int)(rdtsc() - t0);
+}
+
+/* Compare the byte loops with the rep and SSE2 variants */
+void run_string_benchmark() {
+    unsigned char* src = (unsigned char*)page_alloc_flags(BENCH_BYTES / PAGE_SIZE, PAGE_NOZERO);
+    unsigned char* dst = (unsigned char*)page_alloc_flags(BENCH_BYTES / PAGE_SIZE, PAGE_NOZERO);
+    unsigned int total = BENCH_BYTES * BENCH_ROUNDS;
+
+    if (src == 0 || dst == 0) {
+        print("Not enough memory for the benchmark\n");
+        if (src) page_free(src);
+        if (dst) page_free(dst);
+        return;
+    }
+
+    kprintf("\nString benchmark (%d KB x %d), SSE2 %s\n", BENCH_BYTES / 1024, BENCH_ROUNDS,
+            has_sse2 ? "available" : "not available");
+
+    bench_report("memset bytes    ", total, time_fill(memset_bytes, dst));
+    bench_report("memset rep stosd", total, time_fill(memset_rep, dst));
+    if (has_sse2) {
+        bench_report("memset sse2 nt  ", total, time_fill(memset_sse2, dst));
+    }
+
+    bench_report("memcpy bytes    ", total, time_copy(memcpy_bytes, dst, src));
+    bench_report("memcpy rep movsd", total, time_copy(memcpy_rep, dst, src));
+    if (has_sse2) {
+        bench_report("memcpy sse2 nt  ", total, time_copy(memcpy_sse2, dst, src));
+    }
+
+    // One long string for strlen/strcmp
+    memset_rep(src, 'a', BENCH_BYTES);
+    memset_rep(dst, 'a', BENCH_BYTES);
+    src[BENCH_BYTES - 1] = '\0';
+    dst[BENCH_BYTES - 1] = '\0';
+
+    unsigned long long t0 = rdtsc();
+    for (int i = 0; i < BENCH_ROUNDS; i++) bench_sink = strlen_bytes((char*)src);
+    bench_report("strlen bytes    ", total, (unsigned int)(rdtsc() - t0));
+    t0 = rdtsc();
+    for (int i = 0; i < BENCH_ROUNDS; i++) bench_sink = strlen((char*)src);
+    bench_report("strlen words    ", total, (unsigned int)(rdtsc() - t0));
+    t0 = rdtsc();
+    for (int i = 0; i < BENCH_ROUNDS; i++) bench_sink = strcmp((char*)src, (char*)dst);
+    bench_report("strcmp words    ", total, (unsigned int)(rdtsc() - t0));
+
+    page_free(src);
+    page_free(dst);
+}
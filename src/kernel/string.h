@@ -0,0 +1,29 @@
+#ifndef STRING_H
+#define STRING_H
+
+#include "memory.h"
+
+/* Sizes at or above this use the non-temporal SSE2 routines when the CPU
+   has them - large enough that the data would only evict useful cache lines */
+#define STRING_NT_THRESHOLD (64 * 1024)
+
+/* Set up the CPUID-selected variants (enables SSE when present) */
+void init_string();
+int string_has_sse2();
+
+/* Memory primitives */
+void* memset(void* dst, int value, size_t n);
+void* memcpy(void* dst, const void* src, size_t n);
+void* memmove(void* dst, const void* src, size_t n);
+void* memset_nt(void* dst, int value, size_t n);   /* Bypass the cache if possible */
+void memsetw(unsigned short* dst, unsigned short value, size_t count);
+
+/* String primitives */
+size_t strlen(const char* str);
+int strcmp(const char* str1, const char* str2);
+int strncmp(const char* str1, const char* str2, size_t n);
+
+/* Benchmark */
+void run_string_benchmark();        /* Print bytes per cycle for each variant */
+
+#endif /* STRING_H */
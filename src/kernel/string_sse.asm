@@ -0,0 +1,61 @@
+; string_sse.asm - SSE2 non-temporal fill and copy loops
+; Called from string.c once CPUID has shown SSE2 and CR0/CR4 allow it.
+; dst must be 16-byte aligned and n a multiple of 64 - string.c handles
+; the unaligned head and the tail.
+[bits 32]
+[global memset_sse2_nt]
+[global memcpy_sse2_nt]
+
+section .text
+
+; void memset_sse2_nt(void* dst, int value, size_t n)
+memset_sse2_nt:
+    push edi
+    mov edi, [esp + 8]          ; dst
+    movzx eax, byte [esp + 12]  ; value, replicated into every byte
+    imul eax, eax, 0x01010101
+    movd xmm0, eax
+    pshufd xmm0, xmm0, 0
+    mov ecx, [esp + 16]         ; n / 64 iterations
+    shr ecx, 6
+    jz .done
+.fill:
+    movntdq [edi], xmm0
+    movntdq [edi + 16], xmm0
+    movntdq [edi + 32], xmm0
+    movntdq [edi + 48], xmm0
+    add edi, 64
+    dec ecx
+    jnz .fill
+    sfence                      ; Order the streaming stores
+.done:
+    pop edi
+    ret
+
+; void memcpy_sse2_nt(void* dst, const void* src, size_t n)
+memcpy_sse2_nt:
+    push edi
+    push esi
+    mov edi, [esp + 12]         ; dst
+    mov esi, [esp + 16]         ; src, any alignment
+    mov ecx, [esp + 20]         ; n / 64 iterations
+    shr ecx, 6
+    jz .done
+.copy:
+    movdqu xmm0, [esi]
+    movdqu xmm1, [esi + 16]
+    movdqu xmm2, [esi + 32]
+    movdqu xmm3, [esi + 48]
+    movntdq [edi], xmm0
+    movntdq [edi + 16], xmm1
+    movntdq [edi + 32], xmm2
+    movntdq [edi + 48], xmm3
+    add esi, 64
+    add edi, 64
+    dec ecx
+    jnz .copy
+    sfence                      ; Order the streaming stores
+.done:
+    pop esi
+    pop edi
+    ret
@@ -0,0 +1,39 @@
+; switch.asm - Kernel thread context switch
+; Saves the callee-saved registers and EFLAGS on the old thread's stack,
+; then resumes the new thread from its own. A new thread's stack is built
+; by thread_create() so this "returns" into thread_start.
+[bits 32]
+[global switch_context]
+
+section .text
+
+; void switch_context(unsigned int* old_esp, unsigned int new_esp,
+;                     void* old_fx, void* new_fx)
+; The FXSAVE areas are 0 when SSE is not in use.
+switch_context:
+    mov eax, [esp + 4]          ; &old->esp
+    mov edx, [esp + 8]          ; new->esp
+    mov ecx, [esp + 12]
+    test ecx, ecx
+    jz .save
+    fxsave [ecx]
+.save:
+    mov ecx, [esp + 16]         ; Read before the stack changes
+    push ebp
+    push ebx
+    push esi
+    push edi
+    pushfd
+    mov [eax], esp
+
+    mov esp, edx
+    test ecx, ecx
+    jz .restore
+    fxrstor [ecx]
+.restore:
+    popfd
+    pop edi
+    pop esi
+    pop ebx
+    pop ebp
+    ret
@@ -0,0 +1,310 @@
+/* thread.c - Kernel threads and the priority round-robin scheduler */
+#include "thread.h"
+#include "memory.h"
+#include "string.h"
+#include "clock.h"
+#include "cpu.h"
+#include "kprintf.h"
+
+/* Forward declaration of print function */
+void print(const char *str);
+
+/* Save the old thread's registers and resume the new one (switch.asm) */
+void switch_context(unsigned int* old_esp, unsigned int new_esp, void* old_fx, void* new_fx);
+
+static thread_t boot_thread;
+static thread_t* current = 0;
+static thread_t* run_head[THREAD_PRIORITIES];   // Ready threads, FIFO per priority
+static thread_t* run_tail[THREAD_PRIORITIES];
+static thread_t* sleepers = 0;                  // Unordered, checked every tick
+static thread_t* all_threads = 0;
+static int next_id = 0;
+static int need_resched = 0;                    // Switch at the end of this IRQ
+static int use_fx = 0;                          // SSE is on, switch its registers
+static unsigned long long switched_in_ns = 0;   // When current started running
+static unsigned int context_switches = 0;
+static unsigned int preemptions = 0;
+
+static const char* state_names[] = { "ready", "running", "sleeping", "blocked", "dead" };
+
+/* Make a thread ready, behind others of its priority */
+static void enqueue(thread_t* thread) {
+    int prio = thread->priority;
+
+    thread->state = THREAD_READY;
+    thread->next = 0;
+    if (run_tail[prio]) {
+        run_tail[prio]->next = thread;
+    } else {
+        run_head[prio] = thread;
+    }
+    run_tail[prio] = thread;
+
+    if (current && prio < current->priority) {
+        need_resched = 1;
+    }
+}
+
+/* Take the first thread of the highest priority that has one */
+static thread_t* dequeue() {
+    for (int prio = 0; prio < THREAD_PRIORITIES; prio++) {
+        thread_t* thread = run_head[prio];
+        if (thread) {
+            run_head[prio] = thread->next;
+            if (run_head[prio] == 0) {
+                run_tail[prio] = 0;
+            }
+            return thread;
+        }
+    }
+    return 0;
+}
+
+/* Switch to the best ready thread. Interrupts must be off. A running
+   thread goes to the back of its queue; one that has set itself
+   sleeping, blocked or dead stays off the queues. preempted counts
+   switches forced on the thread by an interrupt. */
+static void schedule(int preempted) {
+    thread_t* prev = current;
+
+    if (prev->state == THREAD_RUNNING) {
+        enqueue(prev);
+    }
+    // The idle thread never waits, so there is always a ready thread
+    thread_t* next = dequeue();
+    need_resched = 0;
+
+    next->state = THREAD_RUNNING;
+    next->slice = THREAD_SLICE_TICKS(next->priority);
+    if (next == prev) {
+        return;
+    }
+
+    unsigned long long now = clock_ns();
+    prev->cpu_ns += now - switched_in_ns;
+    switched_in_ns = now;
+    next->switches++;
+    context_switches++;
+    if (preempted) {
+        preemptions++;
+    }
+    current = next;
+
+    switch_context(&prev->esp, next->esp, use_fx ? prev->fx : 0, use_fx ? next->fx : 0);
+}
+
+/* First code a new thread runs, on its own stack with interrupts off */
+static void thread_start() {
+    __asm__ volatile("sti");
+    thread_exit(current->entry(current->arg));
+}
+
+/* Common setup of a thread structure */
+static void thread_init(thread_t* thread, const char* name, int priority) {
+    memset(thread, 0, sizeof(thread_t));
+    thread->id = next_id++;
+    for (int i = 0; i < THREAD_NAME_LEN - 1 && name[i]; i++) {
+        thread->name[i] = name[i];
+    }
+    thread->priority = priority;
+
+    // A clean FPU/SSE state: all exceptions masked
+    thread->fx = (unsigned char*)(((unsigned int)thread->fx_area + 15) & ~15);
+    *(unsigned short*)thread->fx = 0x037F;          // x87 control word
+    *(unsigned int*)(thread->fx + 24) = 0x1F80;     // MXCSR
+
+    thread->all_next = all_threads;
+    all_threads = thread;
+}
+
+/* Turn the code running on the boot stack into the idle thread and
+   start scheduling. Needs the clock and kmalloc(). */
+void init_threads() {
+    unsigned int flags = irq_save();
+
+    thread_init(&boot_thread, "idle", THREAD_PRIO_IDLE);
+    boot_thread.state = THREAD_RUNNING;
+    boot_thread.slice = THREAD_SLICE_TICKS(THREAD_PRIO_IDLE);
+    use_fx = string_has_sse2();
+    switched_in_ns = clock_ns();
+    current = &boot_thread;
+
+    irq_restore(flags);
+}
+
+/* Start a thread running entry(arg). It gets the CPU at the next timer
+   tick if it outranks the caller, otherwise when its turn comes. */
+thread_t* thread_create(const char* name, thread_func_t entry, void* arg, int priority) {
+    if (priority < 0 || priority >= THREAD_PRIO_IDLE) {
+        return 0;
+    }
+
+    thread_t* thread = (thread_t*)kmalloc(sizeof(thread_t));
+    if (thread == 0) {
+        return 0;
+    }
+    void* stack = page_alloc_flags(THREAD_STACK_PAGES, PAGE_NOZERO);
+    if (stack == 0) {
+        kfree(thread);
+        return 0;
+    }
+
+    // What switch_context() pops: EFLAGS, edi, esi, ebx, ebp, return address
+    unsigned int* sp = (unsigned int*)((unsigned char*)stack + THREAD_STACK_PAGES * PAGE_SIZE);
+    *--sp = 0;                          // thread_start never returns
+    *--sp = (unsigned int)thread_start;
+    *--sp = 0;                          // ebp
+    *--sp = 0;                          // ebx
+    *--sp = 0;                          // esi
+    *--sp = 0;                          // edi
+    *--sp = 0x002;                      // EFLAGS, interrupts off
+
+    unsigned int flags = irq_save();
+    thread_init(thread, name, priority);
+    thread->stack = stack;
+    thread->entry = entry;
+    thread->arg = arg;
+    thread->esp = (unsigned int)sp;
+    enqueue(thread);
+    irq_restore(flags);
+
+    return thread;
+}
+
+/* Running thread */
+thread_t* thread_current() {
+    return current;
+}
+
+/* Let other ready threads of the same or higher priority run */
+void thread_yield() {
+    unsigned int flags = irq_save();
+    schedule(0);
+    irq_restore(flags);
+}
+
+/* Sleep for at least ms milliseconds - woken by the first tick after */
+void thread_sleep(unsigned int ms) {
+    unsigned int flags = irq_save();
+
+    current->wake_ns = clock_ns() + (unsigned long long)ms * 1000000;
+    current->state = THREAD_SLEEPING;
+    current->next = sleepers;
+    sleepers = current;
+    schedule(0);
+
+    irq_restore(flags);
+}
+
+/* Stop running until thread_wake(). Call with interrupts off after
+   checking the wake-up condition, so a wake-up cannot slip in between. */
+void thread_block() {
+    current->state = THREAD_BLOCKED;
+    schedule(0);
+}
+
+/* Make a blocked thread ready. Safe from interrupt handlers. */
+void thread_wake(thread_t* thread) {
+    unsigned int flags = irq_save();
+    if (thread->state == THREAD_BLOCKED) {
+        enqueue(thread);
+    }
+    irq_restore(flags);
+}
+
+/* End the running thread. Its stack is freed by thread_join(). */
+void thread_exit(int code) {
+    __asm__ volatile("cli");
+
+    current->exit_code = code;
+    current->state = THREAD_DEAD;
+    if (current->joiner) {
+        thread_wake(current->joiner);
+    }
+    schedule(0);
+
+    // A dead thread is never switched back to
+    while (1) {
+        __asm__ volatile("hlt");
+    }
+}
+
+/* Wait for a thread to finish, free it and return its exit code.
+   Returns -1 for the running thread or the idle thread. */
+int thread_join(thread_t* thread) {
+    if (thread == 0 || thread == current || thread == &boot_thread) {
+        return -1;
+    }
+
+    unsigned int flags = irq_save();
+    while (thread->state != THREAD_DEAD) {
+        thread->joiner = current;
+        thread_block();
+    }
+
+    thread_t** link = &all_threads;
+    while (*link != thread) {
+        link = &(*link)->all_next;
+    }
+    *link = thread->all_next;
+    irq_restore(flags);
+
+    int code = thread->exit_code;
+    page_free(thread->stack);
+    kfree(thread);
+    return code;
+}
+
+/* Timer interrupt: wake sleepers whose time has come and charge the
+   tick to the running thread's slice */
+void thread_tick() {
+    if (current == 0) {
+        return;
+    }
+
+    unsigned long long now = clock_ns();
+    thread_t** link = &sleepers;
+    while (*link) {
+        thread_t* thread = *link;
+        if (now >= thread->wake_ns) {
+            *link = thread->next;
+            enqueue(thread);
+        } else {
+            link = &thread->next;
+        }
+    }
+
+    if (--current->slice <= 0) {
+        need_resched = 1;
+    }
+}
+
+/* Called at the end of every IRQ once the PIC has its EOI, so the
+   switched-to thread does not hold up further interrupts */
+void thread_preempt() {
+    if (need_resched && current) {
+        schedule(1);
+    }
+}
+
+/* List threads with their CPU time */
+void print_threads() {
+    unsigned int flags = irq_save();
+    unsigned long long now = clock_ns();
+
+    print("\nThreads:\n");
+    for (thread_t* thread = all_threads; thread; thread = thread->all_next) {
+        unsigned long long cpu = thread->cpu_ns;
+        if (thread == current) {
+            cpu += now - switched_in_ns;
+        }
+
+        kprintf("  %d %s - priority %d, %s, cpu ", thread->id, thread->name,
+                thread->priority, state_names[thread->state]);
+        print_duration(cpu);
+        kprintf(", %u switches\n", thread->switches);
+    }
+    kprintf("Context switches: %u, %u by preemption\n", context_switches, preemptions);
+
+    irq_restore(flags);
+}
@@ -0,0 +1,65 @@
+#ifndef THREAD_H
+#define THREAD_H
+
+/* Kernel stacks come from page_alloc_multiple() */
+#define THREAD_STACK_PAGES  4       /* 16 KB, the same as the boot stack */
+#define THREAD_NAME_LEN     16
+#define THREAD_FX_SIZE      512     /* FXSAVE area, switched while SSE is on */
+
+/* Priorities - a ready thread always runs before any of lower priority */
+#define THREAD_PRIO_HIGH    0
+#define THREAD_PRIO_NORMAL  1
+#define THREAD_PRIO_LOW     2
+#define THREAD_PRIO_IDLE    3       /* Only the boot thread */
+#define THREAD_PRIORITIES   4
+
+/* Time slice in timer ticks. Lower priorities run only when nothing
+   above is ready, so they get longer slices and switch less. */
+#define THREAD_SLICE_TICKS(prio)  (10 << (prio))
+
+/* Thread states */
+#define THREAD_READY     0
+#define THREAD_RUNNING   1
+#define THREAD_SLEEPING  2
+#define THREAD_BLOCKED   3
+#define THREAD_DEAD      4          /* Finished, waiting for thread_join() */
+
+typedef int (*thread_func_t)(void* arg);
+
+typedef struct thread {
+    unsigned int esp;               // Saved stack pointer while switched out
+    unsigned char* fx;              // 16-byte aligned FXSAVE area in fx_area
+    int id;
+    char name[THREAD_NAME_LEN];
+    int state;
+    int priority;
+    int slice;                      // Ticks left of the current time slice
+    unsigned long long wake_ns;     // When a sleeping thread becomes ready
+    unsigned long long cpu_ns;      // Time spent running
+    unsigned int switches;          // Times switched in
+    void* stack;                    // Bottom of the stack, 0 for the boot thread
+    thread_func_t entry;
+    void* arg;
+    int exit_code;
+    struct thread* joiner;          // Thread waiting in thread_join() for this one
+    struct thread* next;            // Run queue or sleep list
+    struct thread* all_next;        // Every thread, for ps
+    unsigned char fx_area[THREAD_FX_SIZE + 16];
+} thread_t;
+
+/* Function prototypes */
+void init_threads();                /* The caller becomes the idle thread. Threads
+                                       only run on the boot CPU (smp.h). */
+thread_t* thread_create(const char* name, thread_func_t entry, void* arg, int priority);
+thread_t* thread_current();         /* 0 before init_threads() */
+void thread_yield();
+void thread_sleep(unsigned int ms);
+int thread_join(thread_t* thread);  /* Frees the thread, returns its exit code */
+void thread_exit(int code);
+void thread_block();                /* Interrupts must be off; see thread_wake() */
+void thread_wake(thread_t* thread);
+void thread_tick();                 /* Timer interrupt */
+void thread_preempt();              /* End of an IRQ, after the EOI */
+void print_threads();
+
+#endif /* THREAD_H */
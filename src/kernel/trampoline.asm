@@ -0,0 +1,67 @@
+; trampoline.asm - Real mode start-up code for application processors
+; init_smp() copies trampoline_start..trampoline_end to SMP_TRAMPOLINE
+; (smp.h) and fills in trampoline_params before each startup IPI. The AP
+; starts at 0800:0000, loads a flat GDT, switches to protected mode and
+; calls the entry point with its cpu_t - that sets up everything else.
+[bits 16]
+[global trampoline_start]
+[global trampoline_end]
+[global trampoline_params]
+
+TRAMPOLINE_BASE equ 0x8000
+
+; Address of a label once the code has been copied
+%define REL(x) ((x) - trampoline_start + TRAMPOLINE_BASE)
+
+section .text
+
+align 16
+trampoline_start:
+    cli
+    cld
+    xor ax, ax
+    mov ds, ax
+    lgdt [REL(trampoline_gdt_ptr)]
+
+    mov eax, cr0
+    or eax, 1                   ; Protected mode
+    mov cr0, eax
+    jmp dword 0x08:REL(trampoline_32)
+
+[bits 32]
+trampoline_32:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+
+    mov esp, [REL(trampoline_params)]       ; Stack top
+    push dword [REL(trampoline_params) + 8] ; cpu_t*
+    mov eax, [REL(trampoline_params) + 4]   ; Entry
+    call eax
+
+    ; The entry never returns, but if it does:
+.halt:
+    cli
+    hlt
+    jmp .halt
+
+; Same flat segments as the boot sector's GDT
+align 8
+trampoline_gdt:
+    dq 0
+    dq 0x00CF9A000000FFFF       ; 0x08: code, base 0, 4 GB
+    dq 0x00CF92000000FFFF       ; 0x10: data, base 0, 4 GB
+trampoline_gdt_ptr:
+    dw trampoline_gdt_ptr - trampoline_gdt - 1
+    dd REL(trampoline_gdt)
+
+; trampoline_params_t in smp.c
+align 4
+trampoline_params:
+    dd 0                        ; Stack top
+    dd 0                        ; Entry
+    dd 0                        ; cpu_t*
+trampoline_end:
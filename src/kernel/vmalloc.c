@@ -0,0 +1,214 @@
+/* vmalloc.c - Virtually contiguous allocations built from single pages */
+#include "vmalloc.h"
+#include "paging.h"
+#include "spinlock.h"
+#include "kprintf.h"
+
+/* Forward declaration of print function */
+void print(const char *str);
+
+#define VMALLOC_END   (VMALLOC_START + VMALLOC_SIZE)
+#define VMALLOC_PAGES (VMALLOC_SIZE / PAGE_SIZE)
+
+static vm_area_t* areas = 0;            // Sorted by address
+static int area_count = 0;
+static int vmalloc_pages = 0;           // Pages mapped by all areas
+static unsigned int vmalloc_failures = 0;
+static spinlock_t vm_lock = SPINLOCK_INIT;  // Guards the area list
+
+/* Unmap the first count pages of an area and give them back */
+static void release_pages(unsigned int start, int count) {
+    for (int i = 0; i < count; i++) {
+        void* virt = (void*)(start + i * PAGE_SIZE);
+        unsigned int phys = paging_get_phys(virt);
+
+        paging_unmap_page(virt);
+        if (phys) {
+            page_free((void*)phys);
+        }
+    }
+}
+
+/* Take the first gap that fits pages plus a guard page, linking area
+   into the list to hold it - vm_lock must be held */
+static int reserve_area(vm_area_t* area, int pages) {
+    unsigned int span = (pages + 1) * PAGE_SIZE;
+    unsigned int start = VMALLOC_START;
+    vm_area_t** link = &areas;
+    while (*link && (*link)->start - start < span) {
+        start = (*link)->start + ((*link)->pages + 1) * PAGE_SIZE;
+        link = &(*link)->next;
+    }
+    if (*link == 0 && VMALLOC_END - start < span) {
+        return 0;
+    }
+
+    area->start = start;
+    area->pages = pages;
+    area->next = *link;
+    *link = area;
+    area_count++;
+    return 1;
+}
+
+/* Back a reserved area with pages. Runs without vm_lock - the area is
+   linked, so no one else maps into it, and nobody knows its address yet. */
+static int map_area(vm_area_t* area) {
+    for (int i = 0; i < area->pages; i++) {
+        void* phys = page_alloc();
+        if (phys == 0 || !paging_map_page((void*)(area->start + i * PAGE_SIZE), (unsigned int)phys, MEM_PERM_RW)) {
+            if (phys) {
+                page_free(phys);
+            }
+            release_pages(area->start, i);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Take area back out of the list after its pages could not be mapped */
+static void unlink_area(vm_area_t* area) {
+    unsigned int flags = spin_lock_irqsave(&vm_lock);
+    vm_area_t** link = &areas;
+    while (*link != area) {
+        link = &(*link)->next;
+    }
+    *link = area->next;
+    area_count--;
+    vmalloc_failures++;
+    spin_unlock_irqrestore(&vm_lock, flags);
+}
+
+/* Allocate size bytes that are contiguous in the vmalloc area. The pages
+   behind them are taken one at a time, so this does not fail because
+   free memory is fragmented. Without paging it falls back to
+   page_alloc_multiple(). */
+void* vmalloc(size_t size) {
+    if (size == 0 || size > VMALLOC_SIZE) {
+        return 0;
+    }
+
+    int pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (!paging_enabled()) {
+        return page_alloc_multiple(pages);
+    }
+
+    vm_area_t* area = (vm_area_t*)kmalloc(sizeof(vm_area_t));
+    if (area == 0) {
+        unsigned int flags = spin_lock_irqsave(&vm_lock);
+        vmalloc_failures++;
+        spin_unlock_irqrestore(&vm_lock, flags);
+        return 0;
+    }
+
+    // Only the address range is claimed under the lock - allocating,
+    // zeroing and mapping the pages happen with it dropped
+    unsigned int flags = spin_lock_irqsave(&vm_lock);
+    int reserved = reserve_area(area, pages);
+    if (!reserved) {
+        vmalloc_failures++;
+    }
+    spin_unlock_irqrestore(&vm_lock, flags);
+    if (!reserved) {
+        kprintf("ERROR: No room for %d pages in the vmalloc area\n", pages);
+        kfree(area);
+        return 0;
+    }
+
+    if (!map_area(area)) {
+        unlink_area(area);
+        kfree(area);
+        return 0;
+    }
+
+    flags = spin_lock_irqsave(&vm_lock);
+    vmalloc_pages += pages;
+    spin_unlock_irqrestore(&vm_lock, flags);
+    return (void*)area->start;
+}
+
+/* Area starting at addr, with the link that points to it */
+static vm_area_t** find_area(void* addr) {
+    vm_area_t** link = &areas;
+    while (*link && (*link)->start < (unsigned int)addr) {
+        link = &(*link)->next;
+    }
+    if (*link == 0 || (*link)->start != (unsigned int)addr) {
+        return 0;
+    }
+    return link;
+}
+
+/* Whether addr lies in the vmalloc area */
+static inline int in_vmalloc_area(void* addr) {
+    return (unsigned int)addr >= VMALLOC_START && (unsigned int)addr < VMALLOC_END;
+}
+
+/* Free an allocation made by vmalloc() */
+void vfree(void* addr) {
+    if (addr == 0) {
+        return;
+    }
+
+    // Made by the page_alloc_multiple() fallback
+    if (!in_vmalloc_area(addr)) {
+        page_free(addr);
+        return;
+    }
+
+    unsigned int flags = spin_lock_irqsave(&vm_lock);
+    vm_area_t** link = find_area(addr);
+    if (link == 0) {
+        spin_unlock_irqrestore(&vm_lock, flags);
+        print("ERROR: Invalid vfree - not the start of a vmalloc area\n");
+        return;
+    }
+
+    vm_area_t* area = *link;
+    release_pages(area->start, area->pages);
+    *link = area->next;
+    area_count--;
+    vmalloc_pages -= area->pages;
+    spin_unlock_irqrestore(&vm_lock, flags);
+    kfree(area);
+}
+
+/* Mapped bytes of a vmalloc() allocation, 0 if addr is not the start of one */
+size_t vmalloc_size(void* addr) {
+    if (addr == 0) {
+        return 0;
+    }
+    if (!in_vmalloc_area(addr)) {
+        return get_page_count(addr) * PAGE_SIZE;
+    }
+
+    vm_area_t** link = find_area(addr);
+    return link ? (*link)->pages * PAGE_SIZE : 0;
+}
+
+/* Print how much of the vmalloc area is in use */
+void print_vmalloc_info() {
+    // Largest gap an allocation could still use, guard page included
+    unsigned int largest = 0;
+    unsigned int start = VMALLOC_START;
+    for (vm_area_t* area = areas; area; area = area->next) {
+        if (area->start - start > largest) {
+            largest = area->start - start;
+        }
+        start = area->start + (area->pages + 1) * PAGE_SIZE;
+    }
+    if (VMALLOC_END - start > largest) {
+        largest = VMALLOC_END - start;
+    }
+
+    kprintf("\nvmalloc area: %u MB - %u MB", VMALLOC_START / (1024 * 1024), VMALLOC_END / (1024 * 1024));
+    if (!paging_enabled()) {
+        print(" (unused, paging is off)\n");
+        return;
+    }
+    kprintf("\n  Areas: %d, %d of %d pages mapped (%d KB)\n", area_count, vmalloc_pages,
+            VMALLOC_PAGES, vmalloc_pages * 4);
+    kprintf("  Largest free range: %u pages\n", largest > PAGE_SIZE ? largest / PAGE_SIZE - 1 : 0);
+    kprintf("  Failed allocations: %u\n", vmalloc_failures);
+}
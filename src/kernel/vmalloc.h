@@ -0,0 +1,20 @@
+#ifndef VMALLOC_H
+#define VMALLOC_H
+
+#include "memory.h"
+
+/* One vmalloc() allocation - pages mapped at start, then an unmapped
+   guard page so overruns fault instead of reaching the next area */
+typedef struct vm_area {
+    unsigned int start;         // First virtual address
+    int pages;                  // Mapped pages, guard page not included
+    struct vm_area* next;       // Next area by address
+} vm_area_t;
+
+/* Function prototypes */
+void* vmalloc(size_t size);     /* Zeroed, virtually contiguous pages */
+void vfree(void* addr);
+size_t vmalloc_size(void* addr); /* Mapped bytes of an allocation, 0 if addr is not one */
+void print_vmalloc_info();
+
+#endif /* VMALLOC_H */
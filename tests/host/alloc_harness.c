@@ -0,0 +1,737 @@
+/* alloc_harness.c - Host build of the page and kmalloc allocators
+ *
+ * memory.c, slab.c and memtrack.c are compiled for the host and linked
+ * into an ordinary program. "Physical memory" is a fixed mapping at
+ * HOST_BASE that init_memory() learns about from a fake E820 map, so the
+ * allocator hands out real host pointers and runs unmodified.
+ *
+ *   alloc_harness bench [ops] [seed]          random traces at several heap sizes
+ *   alloc_harness record <file> [ops] [seed]  write a random trace
+ *   alloc_harness replay <file> [heap MB]     time a recorded trace
+ *   alloc_harness fuzz [seed] [rounds]        check against a reference model
+ *
+ * Trace format, one operation per line (slots name live allocations):
+ *   p <slot> <pages>                 page_alloc_multiple()
+ *   a <slot> <pages> <align> <zone>  page_alloc_aligned(), align in bytes
+ *   k <slot> <bytes>                 kmalloc()
+ *   r <slot> <bytes>                 krealloc()
+ *   f <slot>                         page_free() or kfree()
+ *   z                                page_zero_idle()
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+/* The kernel headers bring their own 32-bit size_t */
+#define size_t kernel_size_t
+#include "memory.h"
+#undef size_t
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+/* Start of the simulated RAM. Below 16 MB so ZONE_DMA is exercised, and
+   above the harness image, which is linked at 4 MB. */
+#define HOST_BASE       0x800000UL
+#define HOST_MAX_HEAP   (64UL << 20)
+
+#define MAX_SLOTS       4096
+#define SAMPLE_EVERY    256     /* Operations between fragmentation samples */
+
+/* Operations in a trace */
+enum { OP_PAGES, OP_ALIGNED, OP_KMALLOC, OP_KREALLOC, OP_FREE, OP_ZERO, OP_KINDS };
+
+static const char* op_names[OP_KINDS] = {
+    "page_alloc", "page_aligned", "kmalloc", "krealloc", "free", "zero_idle"
+};
+
+typedef struct {
+    int kind;
+    int slot;
+    unsigned int arg;       // Pages or bytes
+    unsigned int align;     // OP_ALIGNED: alignment in bytes
+    int zone;               // OP_ALIGNED: zone
+} trace_op_t;
+
+/* A live allocation, as the harness sees it */
+typedef struct {
+    unsigned char* addr;
+    unsigned int bytes;     // Requested size
+    int pages;              // Page allocations: pages, 0 for kmalloc()
+    unsigned char fill;     // Pattern byte written over the block
+} slot_t;
+
+static slot_t slots[MAX_SLOTS];
+static int verbose = 0;
+
+/* Kernel console, normally silent so out-of-memory reports don't swamp
+   the results */
+void print(const char* str) {
+    if (verbose) {
+        fputs(str, stdout);
+    }
+}
+
+void print_int(int num) {
+    if (verbose) {
+        printf("%d", num);
+    }
+}
+
+void print_char(char c) {
+    if (verbose) {
+        putchar(c);
+    }
+}
+
+/* Where kprintf() output goes */
+void console_write(const char* str, kernel_size_t len) {
+    if (verbose) {
+        fwrite(str, 1, len, stdout);
+    }
+}
+
+/* No page tables on the host */
+void init_paging() {
+}
+
+void paging_set_permissions(void* addr, kernel_size_t size, unsigned char perm) {
+    (void)addr;
+    (void)size;
+    (void)perm;
+}
+
+void* memset_nt(void* dest, int value, kernel_size_t count) {
+    return memset(dest, value, count);
+}
+
+/* A single CPU, so one page magazine */
+int smp_cpu_id() {
+    return 0;
+}
+
+static unsigned long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Small deterministic generator, so a seed reproduces a run anywhere */
+static unsigned int rng_state;
+
+static unsigned int rng() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static unsigned int rng_range(unsigned int lo, unsigned int hi) {
+    return lo + rng() % (hi - lo + 1);
+}
+
+/* Map the simulated RAM once, at a fixed address */
+static void map_host_ram() {
+    void* ram = mmap((void*)HOST_BASE, HOST_MAX_HEAP, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE | MAP_NORESERVE, -1, 0);
+    if (ram != (void*)HOST_BASE) {
+        fprintf(stderr, "cannot map simulated RAM at %#lx\n", HOST_BASE);
+        exit(2);
+    }
+}
+
+/* Start over with an empty allocator managing heap_bytes of RAM */
+static void reset_heap(unsigned long heap_bytes) {
+    static e820_map_t map;
+
+    map.count = 1;
+    map.entries[0].base = HOST_BASE;
+    map.entries[0].length = heap_bytes;
+    map.entries[0].type = E820_USABLE;
+    map.entries[0].acpi = 1;
+
+    memset((void*)HOST_BASE, 0, heap_bytes);
+    memset(slots, 0, sizeof(slots));
+    init_memory(&map);
+}
+
+/* Longest run of free pages in the simulated RAM */
+static int largest_free_run() {
+    int best = 0;
+    int run = 0;
+
+    for (unsigned long addr = HOST_BASE; addr < HOST_BASE + HOST_MAX_HEAP; addr += PAGE_SIZE) {
+        if (addr / PAGE_SIZE >= (unsigned long)get_total_pages()) {
+            break;
+        }
+        if (page_is_allocated((void*)addr)) {
+            run = 0;
+        } else if (++run > best) {
+            best = run;
+        }
+    }
+    return best;
+}
+
+/* --- Traces --- */
+
+/* Size of a random kmalloc(): mostly small, now and then several pages */
+static unsigned int random_bytes() {
+    unsigned int r = rng() % 100;
+    if (r < 70) {
+        return rng_range(1, 512);
+    }
+    if (r < 95) {
+        return rng_range(513, 4096);
+    }
+    return rng_range(4097, 65536);
+}
+
+/* Pages for a random page allocation */
+static unsigned int random_pages() {
+    unsigned int r = rng() % 100;
+    if (r < 60) {
+        return 1;
+    }
+    if (r < 90) {
+        return rng_range(2, 16);
+    }
+    return rng_range(17, 256);
+}
+
+/* A random live slot, or -1 */
+static int random_live(int* live, int num_live) {
+    return num_live ? live[rng() % num_live] : -1;
+}
+
+/* Fill ops[] with a random trace that keeps at most max_live slots busy */
+static int generate_trace(trace_op_t* ops, int count, int max_live) {
+    static int live[MAX_SLOTS];
+    static int free_slots[MAX_SLOTS];
+    int num_live = 0;
+    int num_free = 0;
+
+    for (int i = MAX_SLOTS - 1; i >= 0; i--) {
+        free_slots[num_free++] = i;
+    }
+
+    for (int i = 0; i < count; i++) {
+        trace_op_t* op = &ops[i];
+        unsigned int r = rng() % 100;
+
+        // Free more often as the live set fills up
+        int free_bias = num_live * 40 / max_live;
+        memset(op, 0, sizeof(*op));
+
+        if (r < 1) {
+            op->kind = OP_ZERO;
+        } else if (num_live && (r < 35 + free_bias || num_free == 0 || num_live >= max_live)) {
+            int j = rng() % num_live;
+            op->kind = OP_FREE;
+            op->slot = live[j];
+            live[j] = live[--num_live];
+            free_slots[num_free++] = op->slot;
+        } else if (num_live && r < 40 + free_bias) {
+            op->kind = OP_KREALLOC;
+            op->slot = random_live(live, num_live);
+            op->arg = random_bytes();
+        } else {
+            unsigned int k = rng() % 100;
+            op->slot = free_slots[--num_free];
+            live[num_live++] = op->slot;
+            if (k < 55) {
+                op->kind = OP_KMALLOC;
+                op->arg = random_bytes();
+            } else if (k < 92) {
+                op->kind = OP_PAGES;
+                op->arg = random_pages();
+            } else {
+                op->kind = OP_ALIGNED;
+                op->arg = rng_range(1, 16);
+                op->align = PAGE_SIZE << rng_range(0, 6);
+                op->zone = rng() % MEM_ZONES;
+            }
+        }
+    }
+    return count;
+}
+
+static int write_trace(const char* path, trace_op_t* ops, int count) {
+    FILE* f = fopen(path, "w");
+    if (f == 0) {
+        perror(path);
+        return 0;
+    }
+    for (int i = 0; i < count; i++) {
+        trace_op_t* op = &ops[i];
+        switch (op->kind) {
+        case OP_PAGES:    fprintf(f, "p %d %u\n", op->slot, op->arg); break;
+        case OP_ALIGNED:  fprintf(f, "a %d %u %u %d\n", op->slot, op->arg, op->align, op->zone); break;
+        case OP_KMALLOC:  fprintf(f, "k %d %u\n", op->slot, op->arg); break;
+        case OP_KREALLOC: fprintf(f, "r %d %u\n", op->slot, op->arg); break;
+        case OP_FREE:     fprintf(f, "f %d\n", op->slot); break;
+        case OP_ZERO:     fprintf(f, "z\n"); break;
+        }
+    }
+    fclose(f);
+    return 1;
+}
+
+/* Read a trace written by write_trace() or by hand. Returns the number
+   of operations, or -1 on a malformed line. */
+static int read_trace(const char* path, trace_op_t* ops, int max_ops) {
+    FILE* f = fopen(path, "r");
+    char line[128];
+    int count = 0;
+    int line_no = 0;
+
+    if (f == 0) {
+        perror(path);
+        return -1;
+    }
+    while (count < max_ops && fgets(line, sizeof(line), f)) {
+        trace_op_t* op = &ops[count];
+        char c;
+        int n = 0;
+
+        line_no++;
+        memset(op, 0, sizeof(*op));
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+        c = line[0];
+        switch (c) {
+        case 'p': op->kind = OP_PAGES;    n = sscanf(line + 1, "%d %u", &op->slot, &op->arg) == 2; break;
+        case 'a': op->kind = OP_ALIGNED;  n = sscanf(line + 1, "%d %u %u %d", &op->slot, &op->arg,
+                                                     &op->align, &op->zone) == 4; break;
+        case 'k': op->kind = OP_KMALLOC;  n = sscanf(line + 1, "%d %u", &op->slot, &op->arg) == 2; break;
+        case 'r': op->kind = OP_KREALLOC; n = sscanf(line + 1, "%d %u", &op->slot, &op->arg) == 2; break;
+        case 'f': op->kind = OP_FREE;     n = sscanf(line + 1, "%d", &op->slot) == 1; break;
+        case 'z': op->kind = OP_ZERO;     n = 1; break;
+        }
+        if (!n || op->slot < 0 || op->slot >= MAX_SLOTS ||
+            (op->kind == OP_ALIGNED && (op->zone < 0 || op->zone >= MEM_ZONES))) {
+            fprintf(stderr, "%s:%d: bad trace line\n", path, line_no);
+            fclose(f);
+            return -1;
+        }
+        count++;
+    }
+    fclose(f);
+    return count;
+}
+
+/* Release whatever a slot holds */
+static void free_slot(slot_t* s) {
+    if (s->pages) {
+        page_free(s->addr);
+    } else {
+        kfree(s->addr);
+    }
+    memset(s, 0, sizeof(*s));
+}
+
+/* Run one operation. Returns 1 if it asked for memory and got none. */
+static int run_op(trace_op_t* op) {
+    slot_t* s = &slots[op->slot];
+    void* p;
+
+    switch (op->kind) {
+    case OP_PAGES:
+    case OP_ALIGNED:
+    case OP_KMALLOC:
+        if (s->addr) {
+            free_slot(s);
+        }
+        if (op->kind == OP_PAGES) {
+            p = op->arg == 1 ? page_alloc() : page_alloc_multiple(op->arg);
+        } else if (op->kind == OP_ALIGNED) {
+            p = page_alloc_aligned(op->arg, op->align, op->zone);
+        } else {
+            p = kmalloc(op->arg);
+        }
+        if (p == 0) {
+            return 1;
+        }
+        s->addr = p;
+        s->bytes = op->kind == OP_KMALLOC ? op->arg : op->arg * PAGE_SIZE;
+        s->pages = op->kind == OP_KMALLOC ? 0 : op->arg;
+        return 0;
+
+    case OP_KREALLOC:
+        if (s->addr == 0 || s->pages) {
+            return 0;
+        }
+        p = krealloc(s->addr, op->arg);
+        if (p == 0) {
+            return 1;
+        }
+        s->addr = p;
+        s->bytes = op->arg;
+        return 0;
+
+    case OP_FREE:
+        if (s->addr) {
+            free_slot(s);
+        }
+        return 0;
+
+    case OP_ZERO:
+        page_zero_idle();
+        return 0;
+    }
+    return 0;
+}
+
+/* Per-operation results of a replay */
+typedef struct {
+    unsigned long long ns[OP_KINDS];
+    unsigned int count[OP_KINDS];
+    unsigned int failed[OP_KINDS];
+    double peak_fragmentation;      // 1 - largest free run / free pages
+    int peak_free;                  // Free pages at the peak
+    int peak_run;                   // Largest free run at the peak
+    unsigned int peak_used;         // Most pages in use at once
+} replay_result_t;
+
+static void replay(trace_op_t* ops, int count, replay_result_t* result) {
+    memset(result, 0, sizeof(*result));
+
+    for (int i = 0; i < count; i++) {
+        unsigned long long t0 = now_ns();
+        int failed = run_op(&ops[i]);
+        result->ns[ops[i].kind] += now_ns() - t0;
+        result->count[ops[i].kind]++;
+        result->failed[ops[i].kind] += failed;
+
+        if (i % SAMPLE_EVERY == 0) {
+            mem_stats_t stats;
+            mem_get_stats(&stats);
+            if (stats.used_pages > result->peak_used) {
+                result->peak_used = stats.used_pages;
+            }
+            if (stats.free_pages > 0) {
+                int run = largest_free_run();
+                double frag = 1.0 - (double)run / stats.free_pages;
+                if (frag > result->peak_fragmentation) {
+                    result->peak_fragmentation = frag;
+                    result->peak_free = stats.free_pages;
+                    result->peak_run = run;
+                }
+            }
+        }
+    }
+
+    // Leave the heap empty for the next run
+    for (int i = 0; i < MAX_SLOTS; i++) {
+        if (slots[i].addr) {
+            free_slot(&slots[i]);
+        }
+    }
+}
+
+static void print_result(unsigned long heap_bytes, int count, replay_result_t* r) {
+    unsigned int allocs = 0;
+    unsigned int failures = 0;
+
+    printf("Heap %lu MB, %d operations\n", heap_bytes >> 20, count);
+    printf("  %-14s %9s %9s %9s\n", "operation", "count", "ns/op", "failed");
+    for (int k = 0; k < OP_KINDS; k++) {
+        if (r->count[k] == 0) {
+            continue;
+        }
+        printf("  %-14s %9u %9.1f %9u\n", op_names[k], r->count[k],
+               (double)r->ns[k] / r->count[k], r->failed[k]);
+        if (k != OP_FREE && k != OP_ZERO) {
+            allocs += r->count[k];
+            failures += r->failed[k];
+        }
+    }
+    printf("  Failure rate: %.2f%% of %u allocations\n", allocs ? 100.0 * failures / allocs : 0.0, allocs);
+    printf("  Peak use: %u pages\n", r->peak_used);
+    printf("  Peak fragmentation: %.1f%% (largest free run %d of %d free pages)\n\n",
+           100.0 * r->peak_fragmentation, r->peak_run, r->peak_free);
+}
+
+/* Allocated at startup - too big for .bss, which must stay below HOST_BASE */
+#define MAX_TRACE_OPS (1 << 20)
+static trace_op_t* trace;
+
+static int cmd_bench(int ops, unsigned int seed) {
+    static const unsigned long heaps[] = { 4UL << 20, 16UL << 20, 64UL << 20 };
+    replay_result_t result;
+
+    if (ops <= 0 || ops > MAX_TRACE_OPS) {
+        ops = 200000;
+    }
+    rng_state = seed ? seed : 1;
+    generate_trace(trace, ops, 1024);
+    printf("Random trace: %d operations, seed %u\n\n", ops, seed);
+
+    // The same trace at each size - smaller heaps show more failures
+    for (unsigned int h = 0; h < sizeof(heaps) / sizeof(heaps[0]); h++) {
+        reset_heap(heaps[h]);
+        replay(trace, ops, &result);
+        print_result(heaps[h], ops, &result);
+    }
+    return 0;
+}
+
+static int cmd_replay(const char* path, unsigned long heap_mb) {
+    replay_result_t result;
+    int count = read_trace(path, trace, MAX_TRACE_OPS);
+
+    if (count < 0) {
+        return 1;
+    }
+    if (heap_mb == 0 || (heap_mb << 20) > HOST_MAX_HEAP) {
+        heap_mb = 16;
+    }
+    reset_heap(heap_mb << 20);
+    replay(trace, count, &result);
+    print_result(heap_mb << 20, count, &result);
+    return 0;
+}
+
+static int cmd_record(const char* path, int ops, unsigned int seed) {
+    if (ops <= 0 || ops > MAX_TRACE_OPS) {
+        ops = 200000;
+    }
+    rng_state = seed ? seed : 1;
+    generate_trace(trace, ops, 1024);
+    if (!write_trace(path, trace, ops)) {
+        return 1;
+    }
+    printf("Wrote %d operations to %s\n", ops, path);
+    return 0;
+}
+
+/* --- Differential fuzzing --- */
+
+/* The reference model is the set of live slots: blocks must never
+   overlap, page allocations must stay allocated until freed, and every
+   block must keep the pattern written into it. */
+
+static unsigned int fuzz_seed;
+static int fuzz_op;
+
+static void fuzz_fail(const char* what, int slot) {
+    printf("FAIL (seed %u, operation %d, slot %d): %s\n", fuzz_seed, fuzz_op, slot, what);
+    exit(1);
+}
+
+/* Whether [addr, addr + bytes) overlaps a live block other than skip */
+static int overlaps_live(unsigned char* addr, unsigned int bytes, int skip) {
+    for (int i = 0; i < MAX_SLOTS; i++) {
+        slot_t* s = &slots[i];
+        if (i != skip && s->addr && addr < s->addr + s->bytes && s->addr < addr + bytes) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int all_bytes(unsigned char* p, unsigned int n, unsigned char value) {
+    for (unsigned int i = 0; i < n; i++) {
+        if (p[i] != value) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Every live block still holds its pattern, and every page of a page
+   allocation is still marked allocated */
+static void check_live(int check_contents) {
+    for (int i = 0; i < MAX_SLOTS; i++) {
+        slot_t* s = &slots[i];
+        if (s->addr == 0) {
+            continue;
+        }
+        for (int p = 0; p < s->pages; p++) {
+            if (!page_is_allocated(s->addr + p * PAGE_SIZE)) {
+                fuzz_fail("page of a live allocation is marked free", i);
+            }
+        }
+        if (check_contents && !all_bytes(s->addr, s->bytes, s->fill)) {
+            fuzz_fail("live block was overwritten", i);
+        }
+    }
+}
+
+/* Checks on a block the allocator just handed out */
+static void check_new_block(int slot, int zeroed) {
+    slot_t* s = &slots[slot];
+
+    if ((unsigned long)s->addr < HOST_BASE || (unsigned long)s->addr + s->bytes > HOST_BASE + HOST_MAX_HEAP) {
+        fuzz_fail("block outside the heap", slot);
+    }
+    if (overlaps_live(s->addr, s->bytes, slot)) {
+        fuzz_fail("block overlaps a live block", slot);
+    }
+    if (zeroed && !all_bytes(s->addr, s->bytes, 0)) {
+        fuzz_fail("new block is not zeroed", slot);
+    }
+    if (s->pages && get_page_count(s->addr) != s->pages) {
+        fuzz_fail("page count does not match the request", slot);
+    }
+    if (!s->pages && ksize(s->addr) < s->bytes) {
+        fuzz_fail("ksize() smaller than the request", slot);
+    }
+}
+
+/* One fuzzing round on a fresh heap. Page-only rounds also check the
+   free page count exactly after every operation. */
+static void fuzz_round(unsigned long heap_bytes, int ops, int pages_only) {
+    mem_stats_t stats;
+    int live_pages = 0;
+
+    reset_heap(heap_bytes);
+    mem_get_stats(&stats);
+    int initial_free = stats.free_pages;
+
+    for (fuzz_op = 0; fuzz_op < ops; fuzz_op++) {
+        int slot = rng() % 256;
+        slot_t* s = &slots[slot];
+        unsigned int r = rng() % 100;
+
+        if (s->addr && r < 45) {
+            // Free, checking the block was left alone until now
+            if (!all_bytes(s->addr, s->bytes, s->fill)) {
+                fuzz_fail("block was overwritten before it was freed", slot);
+            }
+            live_pages -= s->pages;
+            free_slot(s);
+            check_live(0);
+        } else if (s->addr && !s->pages && r < 60) {
+            // Grow or shrink, the common prefix must survive
+            unsigned int size = random_bytes();
+            unsigned int keep = size < s->bytes ? size : s->bytes;
+            unsigned char* p = krealloc(s->addr, size);
+            if (p == 0) {
+                continue;
+            }
+            if (!all_bytes(p, keep, s->fill)) {
+                fuzz_fail("krealloc() lost data", slot);
+            }
+            s->addr = p;
+            s->bytes = size;
+            check_new_block(slot, 0);
+            memset(p, s->fill, size);
+        } else if (s->addr == 0) {
+            int nozero = 0;
+            if (pages_only || r < 50) {
+                int kind = rng() % 3;
+                s->pages = random_pages();
+                if (kind == 0) {
+                    s->addr = page_alloc_aligned(s->pages, PAGE_SIZE << rng_range(0, 4), rng() % MEM_ZONES);
+                } else if (kind == 1) {
+                    nozero = rng() % 2;
+                    s->addr = page_alloc_flags(s->pages, nozero ? PAGE_NOZERO : 0);
+                } else {
+                    s->addr = page_alloc_multiple(s->pages);
+                }
+                s->bytes = s->pages * PAGE_SIZE;
+            } else {
+                s->bytes = random_bytes();
+                s->addr = kmalloc(s->bytes);
+            }
+            if (s->addr == 0) {
+                memset(s, 0, sizeof(*s));
+                continue;
+            }
+            live_pages += s->pages;
+            s->fill = (unsigned char)(rng() | 1);
+            check_new_block(slot, !nozero);
+            memset(s->addr, s->fill, s->bytes);
+        } else if (r < 70) {
+            page_zero_idle();
+        }
+
+        if (pages_only) {
+            mem_get_stats(&stats);
+            if ((int)stats.free_pages != initial_free - live_pages) {
+                fuzz_fail("free page count disagrees with the live allocations", slot);
+            }
+        }
+        if (fuzz_op % 64 == 0) {
+            check_live(1);
+        }
+    }
+
+    check_live(1);
+    for (int i = 0; i < MAX_SLOTS; i++) {
+        if (slots[i].addr) {
+            free_slot(&slots[i]);
+        }
+    }
+    mem_get_stats(&stats);
+    if (pages_only && (int)stats.free_pages != initial_free) {
+        fuzz_fail("pages missing after everything was freed", -1);
+    }
+}
+
+static int cmd_fuzz(unsigned int seed, int rounds) {
+    static const unsigned long heaps[] = { 2UL << 20, 16UL << 20, 40UL << 20 };
+
+    if (rounds <= 0) {
+        rounds = 30;
+    }
+    for (int round = 0; round < rounds; round++) {
+        fuzz_seed = seed + round;
+        rng_state = fuzz_seed ? fuzz_seed : 1;
+        fuzz_round(heaps[round % 3], 20000, round % 2 == 0);
+    }
+    printf("Fuzz: %d rounds from seed %u passed\n", rounds, seed);
+    return 0;
+}
+
+static void usage() {
+    fprintf(stderr,
+            "usage: alloc_harness [-v] bench [ops] [seed]\n"
+            "       alloc_harness [-v] record <file> [ops] [seed]\n"
+            "       alloc_harness [-v] replay <file> [heap MB]\n"
+            "       alloc_harness [-v] fuzz [seed] [rounds]\n");
+    exit(2);
+}
+
+int main(int argc, char** argv) {
+    int a = 1;
+    if (a < argc && strcmp(argv[a], "-v") == 0) {
+        verbose = 1;
+        a++;
+    }
+    if (a >= argc) {
+        usage();
+    }
+
+    const char* cmd = argv[a++];
+    const char* arg1 = a < argc ? argv[a] : 0;
+    const char* arg2 = a + 1 < argc ? argv[a + 1] : 0;
+    const char* arg3 = a + 2 < argc ? argv[a + 2] : 0;
+
+    map_host_ram();
+    trace = malloc(MAX_TRACE_OPS * sizeof(trace_op_t));
+    if (trace == 0) {
+        fprintf(stderr, "out of memory\n");
+        return 2;
+    }
+
+    if (strcmp(cmd, "bench") == 0) {
+        return cmd_bench(arg1 ? atoi(arg1) : 0, arg2 ? strtoul(arg2, 0, 0) : 1);
+    }
+    if (strcmp(cmd, "record") == 0 && arg1) {
+        return cmd_record(arg1, arg2 ? atoi(arg2) : 0, arg3 ? strtoul(arg3, 0, 0) : 1);
+    }
+    if (strcmp(cmd, "replay") == 0 && arg1) {
+        return cmd_replay(arg1, arg2 ? strtoul(arg2, 0, 0) : 0);
+    }
+    if (strcmp(cmd, "fuzz") == 0) {
+        return cmd_fuzz(arg1 ? strtoul(arg1, 0, 0) : 1, arg2 ? atoi(arg2) : 0);
+    }
+    usage();
+    return 2;
+}